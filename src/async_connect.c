@@ -22,7 +22,10 @@
 #include <ev.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include "async_connect.h"
@@ -31,15 +34,95 @@
 
 #define UNUSED(x) do {(void)(x);} while (0)
 
-extern struct ev_loop *loop;
+#ifndef MSG_FASTOPEN
+#  define MSG_FASTOPEN 0x20000000
+#endif
+#ifndef TCPI_OPT_SYN_DATA
+#  define TCPI_OPT_SYN_DATA 32
+#endif
+
+// 记录不接受 TFO 的目标地址，直接映射，冲突时覆盖
+#define REFUSED_SLOTS 1024
+
+// 不接受 TFO 的记录在这么多秒后失效，之后再试一次
+#define REFUSED_TTL 3600.0
+
+extern __thread struct ev_loop *loop;
 
 typedef struct
 {
 	void (*cb)(int, void *);
 	void *data;
 	ev_io w;
+	// 以下仅用于 TCP Fast Open
+	int fastopen;
+	size_t *len;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
 } ctx_t;
 
+typedef struct
+{
+	uint8_t key[20];	// 端口和地址
+	ev_tstamp until;
+} refused_t;
+
+// 每个事件循环一份，不需要加锁
+static __thread refused_t refused[REFUSED_SLOTS];
+
+// 内核不支持 TFO 时不再尝试
+static __thread int unsupported = 0;
+
+static int make_key(uint8_t *key, const struct sockaddr *addr)
+{
+	bzero(key, 20);
+	if (addr->sa_family == AF_INET)
+	{
+		memcpy(key, &((const struct sockaddr_in *)addr)->sin_port, 2);
+		memcpy(key + 2, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+		return 0;
+	}
+	else if (addr->sa_family == AF_INET6)
+	{
+		memcpy(key, &((const struct sockaddr_in6 *)addr)->sin6_port, 2);
+		memcpy(key + 4, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+		return 0;
+	}
+	return -1;
+}
+
+static refused_t *slot(const uint8_t *key)
+{
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < 20; i++)
+	{
+		h = (h ^ key[i]) * 16777619u;
+	}
+	return &refused[h & (REFUSED_SLOTS - 1)];
+}
+
+static int is_refused(const struct sockaddr *addr)
+{
+	uint8_t key[20];
+	if (make_key(key, addr) != 0)
+	{
+		return 1;
+	}
+	refused_t *r = slot(key);
+	return (memcmp(r->key, key, 20) == 0) && (ev_now(loop) < r->until);
+}
+
+static void set_refused(const struct sockaddr *addr)
+{
+	uint8_t key[20];
+	if (make_key(key, addr) == 0)
+	{
+		refused_t *r = slot(key);
+		memcpy(r->key, key, 20);
+		r->until = ev_now(loop) + REFUSED_TTL;
+	}
+}
+
 static void connect_cb(EV_P_ ev_io *w, int revents)
 {
 	ctx_t *ctx = (ctx_t *)(w->data);
@@ -49,17 +132,44 @@ static void connect_cb(EV_P_ ev_io *w, int revents)
 
 	ev_io_stop(EV_A_ w);
 
-	if (getsockerror(w->fd) == 0)
+	int error = getsockerror(w->fd);
+	if (error == 0)
 	{
 		// 连接成功
+		if (ctx->fastopen && (*ctx->len > 0))
+		{
+			// SYN 中的数据没有被确认，说明对方不接受 TFO，数据已经由内核重传
+			struct tcp_info info;
+			socklen_t optlen = sizeof(info);
+			if ((getsockopt(w->fd, IPPROTO_TCP, TCP_INFO, &info, &optlen) == 0)
+			    && !(info.tcpi_options & TCPI_OPT_SYN_DATA))
+			{
+				set_refused((struct sockaddr *)&ctx->addr);
+			}
+		}
 		(ctx->cb)(w->fd, ctx->data);
 		free(ctx);
 	}
+	else if (ctx->fastopen && (*ctx->len > 0) && (error == ETIMEDOUT))
+	{
+		// 带数据的 SYN 一直没有回应，可能被中间设备丢弃，不使用 TFO 重新连接；
+		// 其他错误（拒绝、不可达等）与 TFO 无关，重试只会让失败的连接多等一轮
+		LOG("fastopen timed out, retry without it");
+		close(w->fd);
+		set_refused((struct sockaddr *)&ctx->addr);
+		*ctx->len = 0;
+		async_connect((struct sockaddr *)&ctx->addr, ctx->addrlen, ctx->cb, ctx->data);
+		free(ctx);
+	}
 	else
 	{
 		// 连接失败
 		LOG("connect failed");
 		close(w->fd);
+		if (ctx->fastopen)
+		{
+			*ctx->len = 0;
+		}
 		(ctx->cb)(-1, ctx->data);
 		free(ctx);
 	}
@@ -77,6 +187,7 @@ void async_connect(const struct sockaddr *addr, socklen_t addrlen,
 	}
 	ctx->cb = cb;
 	ctx->data = data;
+	ctx->fastopen = 0;
 
 	int sock = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
 	if (sock < 0)
@@ -105,3 +216,80 @@ void async_connect(const struct sockaddr *addr, socklen_t addrlen,
 	ctx->w.data = (void *)ctx;
 	ev_io_start(loop, &(ctx->w));
 }
+
+// 使用 TCP Fast Open 连接，buf 中的 *len 字节数据随 SYN 一起发送
+// 回调时 *len 为已经发出的字节数，没有 cookie 或者目标不接受 TFO 时为 0
+void async_fastopen(const struct sockaddr *addr, socklen_t addrlen,
+                    const void *buf, size_t *len,
+                    void (*cb)(int, void *), void *data)
+{
+	if ((*len == 0) || unsupported || is_refused(addr)
+	    || (addrlen > sizeof(struct sockaddr_storage)))
+	{
+		*len = 0;
+		async_connect(addr, addrlen, cb, data);
+		return;
+	}
+
+	ctx_t *ctx = (ctx_t *)malloc(sizeof(ctx_t));
+	if (ctx == NULL)
+	{
+		LOG("out of memory");
+		*len = 0;
+		(cb)(-1, data);
+		return;
+	}
+	ctx->cb = cb;
+	ctx->data = data;
+	ctx->fastopen = 1;
+	ctx->len = len;
+	memcpy(&ctx->addr, addr, addrlen);
+	ctx->addrlen = addrlen;
+
+	int sock = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+	if (sock < 0)
+	{
+		ERROR("socket");
+		free(ctx);
+		*len = 0;
+		(cb)(-1, data);
+		return;
+	}
+	setnonblock(sock);
+	settimeout(sock);
+	setkeepalive(sock);
+	// 有 cookie 时数据放在 SYN 中，否则内核发送普通 SYN 并请求 cookie
+	ssize_t n = sendto(sock, buf, *len, MSG_FASTOPEN | MSG_NOSIGNAL, addr, addrlen);
+	if (n < 0)
+	{
+		if (errno == EINPROGRESS)
+		{
+			n = 0;
+		}
+		else if ((errno == EOPNOTSUPP) || (errno == EPIPE))
+		{
+			// 内核没有启用客户端 TFO（net.ipv4.tcp_fastopen）
+			LOG("fastopen not supported by kernel, disabled");
+			unsupported = 1;
+			close(sock);
+			free(ctx);
+			*len = 0;
+			async_connect(addr, addrlen, cb, data);
+			return;
+		}
+		else
+		{
+			// 连接失败
+			LOG("connect failed");
+			close(sock);
+			free(ctx);
+			*len = 0;
+			(cb)(-1, data);
+			return;
+		}
+	}
+	*len = (size_t)n;
+	ev_io_init(&(ctx->w), connect_cb, sock, EV_WRITE);
+	ctx->w.data = (void *)ctx;
+	ev_io_start(loop, &(ctx->w));
+}
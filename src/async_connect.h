@@ -24,5 +24,8 @@
 
 extern void async_connect(const struct sockaddr *addr, socklen_t addrlen,
                           void (*cb)(int, void *), void *data);
+extern void async_fastopen(const struct sockaddr *addr, socklen_t addrlen,
+                           const void *buf, size_t *len,
+                           void (*cb)(int, void *), void *data);
 
 #endif // ASYNC_CONNECT_H
@@ -18,48 +18,76 @@
  */
 
 #include <assert.h>
+#include <ev.h>
 #include <netdb.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include "async_resolv.h"
 #include "log.h"
+#include "mpsc.h"
 
 #define UNUSED(x) do {(void)(x);} while (0)
 
 // 最大域名解析次数
 #define MAX_TRY 3
 
+// 每个事件循环一份：getaddrinfo_a 在自己的线程中通知解析完成，
+// 通知线程把请求放入发起请求的循环的队列，再用 ev_async 唤醒该循环，
+// 回调总是在发起请求的线程中执行
 typedef struct
 {
+	struct ev_loop *loop;
+	ev_async w_async;
+	mpsc_t done;
+} resolver_t;
+
+typedef struct
+{
+	mpsc_node_t node;
 	struct gaicb req;
 	struct addrinfo hints;
 	struct addrinfo *res;
 	void (*cb)(struct addrinfo *, void *);
 	void *data;
 	int tried;
+	resolver_t *owner;
 	char host[257];
 	char port[15];
 } ctx_t;
 
-static void resolv_cb(int signo, siginfo_t *info, void *context);
+static void notify(union sigval value);
+static void resolv_cb(EV_P_ ev_async *w, int revents);
+static void complete(ctx_t *ctx);
+
+extern __thread struct ev_loop *loop;
+
+static __thread resolver_t resolver;
 
 int resolv_init(void)
 {
-	// SIGIO 信号
-	struct sigaction sa;
-	sa.sa_handler = (void(*) (int))resolv_cb;
-	sigemptyset(&sa.sa_mask);
-	sa.sa_flags = SA_RESTART | SA_SIGINFO;
-	if (sigaction(SIGIO, &sa, NULL) != 0)
+	resolver.loop = loop;
+	mpsc_init(&(resolver.done));
+	ev_async_init(&(resolver.w_async), resolv_cb);
+	ev_async_start(EV_A_ &(resolver.w_async));
+	return 0;
+}
+
+static int submit(ctx_t *ctx)
+{
+	struct gaicb *req_ptr = &(ctx->req);
+	struct sigevent sevp;
+	bzero(&sevp, sizeof(sevp));
+	sevp.sigev_notify = SIGEV_THREAD;
+	sevp.sigev_notify_function = notify;
+	sevp.sigev_value.sival_ptr = (void *)ctx;
+	if (getaddrinfo_a(GAI_NOWAIT, &req_ptr, 1, &sevp) != 0)
 	{
-		LOG("failed to setup SIGIO handler");
+		ERROR("getaddrinfo_a");
 		return -1;
 	}
-	else
-	{
-		return 0;
-	}
+	ctx->tried++;
+	return 0;
 }
 
 void async_resolv(const char *host, const char *port,
@@ -87,28 +115,41 @@ void async_resolv(const char *host, const char *port,
 	ctx->cb = cb;
 	ctx->data = data;
 	ctx->tried = 0;
+	ctx->owner = &resolver;
 
-	struct gaicb *req_ptr = &(ctx->req);
-	struct sigevent sevp;
-	sevp.sigev_notify = SIGEV_SIGNAL;
-	sevp.sigev_signo = SIGIO;
-	sevp.sigev_value.sival_ptr = (void *)ctx;
-	if (getaddrinfo_a(GAI_NOWAIT, &req_ptr, 1, &sevp) != 0)
+	if (submit(ctx) != 0)
 	{
-		ERROR("getaddrinfo_a");
 		(ctx->cb)(NULL, ctx->data);
 		free(ctx);
-		return;
 	}
-	ctx->tried++;
 }
 
-static void resolv_cb(int signo, siginfo_t *info, void *context)
+// 在 getaddrinfo_a 的通知线程中执行
+static void notify(union sigval value)
 {
-	ctx_t *ctx = (ctx_t *)info->si_value.sival_ptr;
+	ctx_t *ctx = (ctx_t *)value.sival_ptr;
+	resolver_t *owner = ctx->owner;
+	mpsc_push(&(owner->done), &(ctx->node));
+	ev_async_send(owner->loop, &(owner->w_async));
+}
+
+static void resolv_cb(EV_P_ ev_async *w, int revents)
+{
+	UNUSED(loop);
+	UNUSED(w);
+	UNUSED(revents);
+
+	mpsc_node_t *node = mpsc_pop_all(&(resolver.done));
+	while (node != NULL)
+	{
+		mpsc_node_t *next = node->next;
+		complete((ctx_t *)node);
+		node = next;
+	}
+}
 
-	UNUSED(context);
-	assert(signo == SIGIO);
+static void complete(ctx_t *ctx)
+{
 	assert(ctx != NULL);
 
 	if (gai_error(&(ctx->req)) == 0)
@@ -123,19 +164,11 @@ static void resolv_cb(int signo, siginfo_t *info, void *context)
 		if (ctx->tried < MAX_TRY)
 		{
 			LOG("failed to resolv host: %s, try again", ctx->host);
-			struct gaicb *req_ptr = &(ctx->req);
-			struct sigevent sevp;
-			sevp.sigev_notify = SIGEV_SIGNAL;
-			sevp.sigev_signo = SIGIO;
-			sevp.sigev_value.sival_ptr = (void *)ctx;
-			if (getaddrinfo_a(GAI_NOWAIT, &req_ptr, 1, &sevp) != 0)
+			if (submit(ctx) != 0)
 			{
-				ERROR("getaddrinfo_a");
 				(ctx->cb)(NULL, ctx->data);
 				free(ctx);
-				return;
 			}
-			ctx->tried++;
 		}
 		else
 		{
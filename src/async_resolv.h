@@ -22,6 +22,8 @@
 
 #include <sys/socket.h>
 
+// 每个调用 async_resolv 的事件循环在自己的线程中调用一次，
+// 回调在发起请求的线程中执行
 extern int resolv_init(void);
 extern void async_resolv(const char *host, const char *port,
                          void (*cb)(struct addrinfo *, void *),
@@ -0,0 +1,281 @@
+/*
+ * breaker.c - per-destination circuit breaker
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <arpa/inet.h>
+#include <ev.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "breaker.h"
+#include "log.h"
+
+#define UNUSED(x) do {(void)(x);} while (0)
+
+// 哈希表大小，直接映射，冲突时覆盖旧的记录
+#define SLOTS 4096
+
+// 连续失败只在这个时间窗口内累计，秒
+#define WINDOW 60.0
+
+// 目标地址：地址族、端口和地址
+typedef struct
+{
+	uint16_t family;
+	uint16_t port;
+	uint8_t addr[16];
+} dest_t;
+
+// 断路器的三种状态：
+//   closed     failures < threshold，正常连接
+//   open       now < open_until，直接失败
+//   half-open  冷却期已过，只放行一个探测连接，probing 记录探测开始的时间
+typedef struct
+{
+	dest_t key;
+	int used;
+	int failures;
+	ev_tstamp first_fail;
+	ev_tstamp open_until;
+	ev_tstamp probing;
+} entry_t;
+
+extern __thread struct ev_loop *loop;
+
+// 多个事件循环线程共用一张表
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int threshold = 0;
+static ev_tstamp cooldown = 30.0;
+static entry_t *table = NULL;
+static unsigned long rejected = 0;
+static ev_signal w_stats;
+
+static void stats_cb(EV_P_ ev_signal *w, int revents);
+static int allow(const struct sockaddr *addr);
+static void report(const struct sockaddr *addr, int ok);
+
+int breaker_init(int k, int secs)
+{
+	if (k <= 0)
+	{
+		return 0;
+	}
+	table = (entry_t *)calloc(SLOTS, sizeof(entry_t));
+	if (table == NULL)
+	{
+		LOG("out of memory");
+		return -1;
+	}
+	threshold = k;
+	if (secs > 0)
+	{
+		cooldown = secs;
+	}
+	ev_signal_init(&w_stats, stats_cb, SIGUSR1);
+	ev_signal_start(EV_A_ &w_stats);
+	return 0;
+}
+
+static int make_key(dest_t *key, const struct sockaddr *addr)
+{
+	bzero(key, sizeof(dest_t));
+	key->family = addr->sa_family;
+	if (addr->sa_family == AF_INET)
+	{
+		const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+		key->port = in->sin_port;
+		memcpy(key->addr, &in->sin_addr, 4);
+		return 0;
+	}
+	else if (addr->sa_family == AF_INET6)
+	{
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+		key->port = in6->sin6_port;
+		memcpy(key->addr, &in6->sin6_addr, 16);
+		return 0;
+	}
+	return -1;
+}
+
+// FNV-1a
+static size_t hash(const dest_t *key)
+{
+	const uint8_t *p = (const uint8_t *)key;
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < sizeof(dest_t); i++)
+	{
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h & (SLOTS - 1);
+}
+
+static entry_t *lookup(const struct sockaddr *addr, int create)
+{
+	dest_t key;
+	if ((table == NULL) || (make_key(&key, addr) != 0))
+	{
+		return NULL;
+	}
+	entry_t *e = &table[hash(&key)];
+	if (e->used && (memcmp(&e->key, &key, sizeof(dest_t)) == 0))
+	{
+		return e;
+	}
+	if (!create)
+	{
+		return NULL;
+	}
+	bzero(e, sizeof(entry_t));
+	e->key = key;
+	e->used = 1;
+	return e;
+}
+
+static const char *ntop(const struct sockaddr *addr, char *buf)
+{
+	if (addr->sa_family == AF_INET)
+	{
+		inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, buf, INET6_ADDRSTRLEN);
+		sprintf(buf + strlen(buf), ":%u", ntohs(((const struct sockaddr_in *)addr)->sin_port));
+	}
+	else
+	{
+		buf[0] = '[';
+		inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)addr)->sin6_addr, buf + 1, INET6_ADDRSTRLEN);
+		sprintf(buf + strlen(buf), "]:%u", ntohs(((const struct sockaddr_in6 *)addr)->sin6_port));
+	}
+	return buf;
+}
+
+// 返回 0 表示断路器打开，不要连接这个地址
+int breaker_allow(const struct sockaddr *addr)
+{
+	if (table == NULL)
+	{
+		return 1;
+	}
+	pthread_mutex_lock(&lock);
+	int ret = allow(addr);
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+void breaker_report(const struct sockaddr *addr, int ok)
+{
+	if (table == NULL)
+	{
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	report(addr, ok);
+	pthread_mutex_unlock(&lock);
+}
+
+static int allow(const struct sockaddr *addr)
+{
+	entry_t *e = lookup(addr, 0);
+	if ((e == NULL) || (e->failures < threshold))
+	{
+		return 1;
+	}
+	ev_tstamp now = ev_now(EV_A);
+	if (now < e->open_until)
+	{
+		rejected++;
+		return 0;
+	}
+	// 半开状态只放行一个探测连接，探测迟迟没有结果时再放行一个
+	if ((e->probing != 0.0) && (now < e->probing + cooldown))
+	{
+		rejected++;
+		return 0;
+	}
+	e->probing = now;
+	return 1;
+}
+
+static void report(const struct sockaddr *addr, int ok)
+{
+	if (ok)
+	{
+		entry_t *e = lookup(addr, 0);
+		if (e != NULL)
+		{
+			if (e->failures >= threshold)
+			{
+				char buf[INET6_ADDRSTRLEN + 8];
+				LOG("circuit closed for %s", ntop(addr, buf));
+			}
+			e->used = 0;
+		}
+		return;
+	}
+
+	entry_t *e = lookup(addr, 1);
+	if (e == NULL)
+	{
+		return;
+	}
+	ev_tstamp now = ev_now(EV_A);
+	if ((e->failures == 0) || (now - e->first_fail > WINDOW))
+	{
+		// 窗口之外的失败不再累计
+		if (e->failures < threshold)
+		{
+			e->failures = 0;
+			e->first_fail = now;
+		}
+	}
+	e->failures++;
+	e->probing = 0.0;
+	if (e->failures >= threshold)
+	{
+		if (e->failures == threshold)
+		{
+			char buf[INET6_ADDRSTRLEN + 8];
+			LOG("circuit open for %s", ntop(addr, buf));
+		}
+		e->open_until = now + cooldown;
+	}
+}
+
+static void stats_cb(EV_P_ ev_signal *w, int revents)
+{
+	UNUSED(loop);
+	UNUSED(w);
+	UNUSED(revents);
+
+	unsigned open = 0;
+	ev_tstamp now = ev_now(EV_A);
+	pthread_mutex_lock(&lock);
+	for (int i = 0; i < SLOTS; i++)
+	{
+		if (table[i].used && (table[i].failures >= threshold))
+		{
+			open += (now < table[i].open_until) ? 1 : 0;
+		}
+	}
+	unsigned long n = rejected;
+	pthread_mutex_unlock(&lock);
+	LOG("breaker: %u destinations open, %lu connections rejected", open, n);
+}
@@ -0,0 +1,29 @@
+/*
+ * breaker.h - per-destination circuit breaker
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BREAKER_H
+#define BREAKER_H
+
+#include <sys/socket.h>
+
+extern int breaker_init(int threshold, int cooldown);
+extern int breaker_allow(const struct sockaddr *addr);
+extern void breaker_report(const struct sockaddr *addr, int ok);
+
+#endif // BREAKER_H
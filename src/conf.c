@@ -49,6 +49,12 @@ static void _strncpy(char *dest, const char *src, size_t n)
 	*(end - 1) = '\0';
 }
 
+static int parse_bool(const char *s)
+{
+	return (strcmp(s, "on") == 0) || (strcmp(s, "yes") == 0)
+	       || (strcmp(s, "true") == 0) || (strcmp(s, "1") == 0);
+}
+
 static int read_conf(const char *file, conf_t *conf)
 {
 	FILE *f = fopen(file, "rb");
@@ -139,6 +145,54 @@ static int read_conf(const char *file, conf_t *conf)
 				{
 					my_strcpy(conf->user, value);
 				}
+				else if (strcmp(name, "edge") == 0)
+				{
+					conf->edge = parse_bool(value);
+				}
+				else if (strcmp(name, "coalesce") == 0)
+				{
+					conf->coalesce = parse_bool(value);
+				}
+				else if (strcmp(name, "buffer_max") == 0)
+				{
+					conf->buffer_max = atoi(value);
+				}
+				else if (strcmp(name, "crypto_threads") == 0)
+				{
+					conf->crypto_threads = atoi(value);
+				}
+				else if (strcmp(name, "loops") == 0)
+				{
+					conf->loops = atoi(value);
+				}
+				else if (strcmp(name, "watchdog") == 0)
+				{
+					conf->watchdog = atoi(value);
+				}
+				else if (strcmp(name, "trace") == 0)
+				{
+					my_strcpy(conf->trace, value);
+				}
+				else if (strcmp(name, "trace_sample") == 0)
+				{
+					conf->trace_sample = atoi(value);
+				}
+				else if (strcmp(name, "telemetry") == 0)
+				{
+					conf->telemetry = atoi(value);
+				}
+				else if (strcmp(name, "breaker") == 0)
+				{
+					conf->breaker = atoi(value);
+				}
+				else if (strcmp(name, "breaker_cooldown") == 0)
+				{
+					conf->breaker_cooldown = atoi(value);
+				}
+				else if (strcmp(name, "fastopen") == 0)
+				{
+					conf->fastopen = parse_bool(value);
+				}
 			}
 			else if (section == server)
 			{
@@ -158,6 +212,18 @@ static int read_conf(const char *file, conf_t *conf)
 				{
 					md5(conf->server[conf->server_num - 1].key, value, strlen(value));
 				}
+				else if (strcmp(name, "compact") == 0)
+				{
+					conf->server[conf->server_num - 1].compact = parse_bool(value);
+				}
+				else if (strcmp(name, "uid") == 0)
+				{
+					conf->server[conf->server_num - 1].uid = (uint32_t)strtoul(value, NULL, 10);
+				}
+				else if (strcmp(name, "users") == 0)
+				{
+					my_strcpy(conf->server[conf->server_num - 1].users, value);
+				}
 			}
 			else if (section == local)
 			{
@@ -180,6 +246,14 @@ static int read_conf(const char *file, conf_t *conf)
 				{
 					my_strcpy(conf->redir.port, value);
 				}
+				else if (strcmp(name, "tproxy") == 0)
+				{
+					conf->redir.tproxy = parse_bool(value);
+				}
+				else if (strcmp(name, "sniff") == 0)
+				{
+					conf->redir.sniff = atoi(value);
+				}
 			}
 			else
 			{
@@ -195,6 +269,18 @@ static int read_conf(const char *file, conf_t *conf)
 	{
 		strcpy(conf->user, "nobody");
 	}
+	if (conf->buffer_max <= 0)
+	{
+		conf->buffer_max = 256;
+	}
+	if (conf->trace_sample <= 0)
+	{
+		conf->trace_sample = 100;
+	}
+	if (conf->breaker_cooldown <= 0)
+	{
+		conf->breaker_cooldown = 30;
+	}
 	if (conf->server_num == 0)
 	{
 		fprintf(stderr, "no server set in config file\n");
@@ -226,11 +312,8 @@ static int read_conf(const char *file, conf_t *conf)
 				}
 				if (conf->server_num < MAX_SERVER)
 				{
-					my_strcpy(conf->server[conf->server_num].address,
-					          conf->server[i].address);
+					conf->server[conf->server_num] = conf->server[i];
 					my_strcpy(conf->server[conf->server_num].port, p1 + 1);
-					my_strcpy(conf->server[conf->server_num].key,
-					          conf->server[i].key);
 					conf->server_num++;
 				}
 				p1 = p2;
@@ -334,7 +417,7 @@ int parse_args(int argc, char **argv, conf_t *conf)
 	}
 	for (int i = 0; i < conf->server_num; i++)
 	{
-		if (conf->server[i].key[0] == '\0')
+		if ((conf->server[i].key[0] == '\0') && (conf->server[i].users[0] == '\0'))
 		{
 			help(argv[0]);
 			return -1;
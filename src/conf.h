@@ -20,6 +20,8 @@
 #ifndef CONF_H
 #define CONF_H
 
+#include <stdint.h>
+
 // 最大服务器数
 #define MAX_SERVER 16
 
@@ -27,6 +29,18 @@ typedef struct
 {
 	int server_num;
 	int daemon;
+	int edge;
+	int crypto_threads;
+	int loops;
+	int coalesce;
+	int buffer_max;
+	int watchdog;
+	char trace[128];
+	int trace_sample;
+	int telemetry;
+	int breaker;
+	int breaker_cooldown;
+	int fastopen;
 	char user[16];
 	char pidfile[64];
 	char logfile[64];
@@ -35,6 +49,9 @@ typedef struct
 		char address[128];
 		char port[128];
 		char key[16];
+		int compact;
+		uint32_t uid;
+		char users[128];
 	} server[MAX_SERVER];
 	struct
 	{
@@ -45,6 +62,8 @@ typedef struct
 	{
 		char address[128];
 		char port[16];
+		int tproxy;
+		int sniff;
 	} redir;
 } conf_t;
 
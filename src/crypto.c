@@ -22,6 +22,7 @@
 #include <string.h>
 #include "crypto.h"
 #include "md5.h"
+#include "profile.h"
 
 #define SWAP(x, y) do {register uint8_t tmp = (x); (x) = (y); (y) = tmp; } while (0)
 
@@ -240,16 +241,22 @@ void crypto_init(crypto_evp_t *evp, const void *key,const void *iv)
 	memcpy(buf, iv, 16);
 	memcpy(buf + 16, key, 16);
 	md5(buf, buf, 32);
+	uint64_t begin = profile_now();
 	rc4_init(&(evp->enc), buf, 16);
+	profile_end(PROF_CRYPTO, begin);
 	evp->dec = evp->enc;
 }
 
 void crypto_encrypt(void *buf, size_t len, crypto_evp_t *evp)
 {
+	uint64_t begin = profile_now();
 	rc4_encrypt(buf, len, &(evp->enc));
+	profile_end(PROF_CRYPTO, begin);
 }
 
 void crypto_decrypt(void *buf, size_t len, crypto_evp_t *evp)
 {
+	uint64_t begin = profile_now();
 	rc4_decrypt(buf, len, &(evp->dec));
+	profile_end(PROF_CRYPTO, begin);
 }
@@ -0,0 +1,189 @@
+/*
+ * csprng.c - ChaCha20 based CSPRNG
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_GETRANDOM
+#  include <sys/random.h>
+#endif
+#include "csprng.h"
+
+// 每次生成的密钥流块数，第一块的前 32 字节作为下一轮的密钥（fast key erasure）
+#define BLOCKS 8
+
+// 输出这么多字节之后从内核重新取种子
+#define RESEED_BYTES (1024 * 1024)
+
+// 每个线程（事件循环）一份状态，取随机数不需要加锁，也不需要系统调用
+static __thread struct
+{
+	int seeded;
+	uint32_t key[8];
+	uint8_t buf[BLOCKS * 64];
+	size_t avail;
+	size_t output;
+} rng;
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QR(a, b, c, d) \
+	do { \
+		a += b; d ^= a; d = ROTL(d, 16); \
+		c += d; b ^= c; b = ROTL(b, 12); \
+		a += b; d ^= a; d = ROTL(d, 8); \
+		c += d; b ^= c; b = ROTL(b, 7); \
+	} while (0)
+
+static void chacha20_block(uint8_t *out, const uint32_t *key, uint32_t counter)
+{
+	uint32_t in[16] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+		key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+		counter, 0, 0, 0
+	};
+	uint32_t x[16];
+	memcpy(x, in, sizeof(x));
+	for (int i = 0; i < 10; i++)
+	{
+		QR(x[0], x[4], x[8],  x[12]);
+		QR(x[1], x[5], x[9],  x[13]);
+		QR(x[2], x[6], x[10], x[14]);
+		QR(x[3], x[7], x[11], x[15]);
+		QR(x[0], x[5], x[10], x[15]);
+		QR(x[1], x[6], x[11], x[12]);
+		QR(x[2], x[7], x[8],  x[13]);
+		QR(x[3], x[4], x[9],  x[14]);
+	}
+	for (int i = 0; i < 16; i++)
+	{
+		uint32_t v = x[i] + in[i];
+		out[i * 4 + 0] = (uint8_t)v;
+		out[i * 4 + 1] = (uint8_t)(v >> 8);
+		out[i * 4 + 2] = (uint8_t)(v >> 16);
+		out[i * 4 + 3] = (uint8_t)(v >> 24);
+	}
+}
+
+// 从内核读取种子
+static int seed(void *buf, size_t len)
+{
+#ifdef HAVE_GETRANDOM
+	while (len > 0)
+	{
+		ssize_t n = getrandom(buf, len, 0);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		buf = (uint8_t *)buf + n;
+		len -= n;
+	}
+	if (len == 0)
+	{
+		return 0;
+	}
+#endif
+	int fd = open("/dev/urandom", O_RDONLY, 0);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	while (len > 0)
+	{
+		ssize_t n = read(fd, buf, len);
+		if (n <= 0)
+		{
+			if ((n < 0) && (errno == EINTR))
+			{
+				continue;
+			}
+			close(fd);
+			return -1;
+		}
+		buf = (uint8_t *)buf + n;
+		len -= n;
+	}
+	close(fd);
+	return 0;
+}
+
+// 生成新一批密钥流，并立即用其中一部分替换密钥，之前的输出无法被回溯
+static int refill(void)
+{
+	if (!rng.seeded || (rng.output >= RESEED_BYTES))
+	{
+		uint32_t fresh[8];
+		if (seed(fresh, sizeof(fresh)) != 0)
+		{
+			return -1;
+		}
+		// 新种子与旧密钥混合，种子质量有问题时也不会比原来更差
+		for (int i = 0; i < 8; i++)
+		{
+			rng.key[i] ^= fresh[i];
+		}
+		memset(fresh, 0, sizeof(fresh));
+		rng.seeded = 1;
+		rng.output = 0;
+	}
+	for (int i = 0; i < BLOCKS; i++)
+	{
+		chacha20_block(rng.buf + i * 64, rng.key, (uint32_t)i);
+	}
+	memcpy(rng.key, rng.buf, sizeof(rng.key));
+	memset(rng.buf, 0, sizeof(rng.key));
+	rng.avail = sizeof(rng.buf) - sizeof(rng.key);
+	return 0;
+}
+
+ssize_t rand_bytes(void *stream, size_t len)
+{
+	uint8_t *p = (uint8_t *)stream;
+	size_t left = len;
+	while (left > 0)
+	{
+		if (rng.avail == 0)
+		{
+			if (refill() != 0)
+			{
+				return -1;
+			}
+		}
+		size_t n = left < rng.avail ? left : rng.avail;
+		uint8_t *src = rng.buf + sizeof(rng.buf) - rng.avail;
+		memcpy(p, src, n);
+		// 用过的部分立即清零
+		memset(src, 0, n);
+		rng.avail -= n;
+		rng.output += n;
+		p += n;
+		left -= n;
+	}
+	return (ssize_t)len;
+}
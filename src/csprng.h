@@ -0,0 +1,28 @@
+/*
+ * csprng.h - ChaCha20 based CSPRNG
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CSPRNG_H
+#define CSPRNG_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+extern ssize_t rand_bytes(void *stream, size_t len);
+
+#endif // CSPRNG_H
@@ -0,0 +1,246 @@
+/*
+ * dispatch.c - hand connections to the least loaded worker loop
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ev.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dispatch.h"
+#include "log.h"
+#include "mpsc.h"
+#include "profile.h"
+#include "relay.h"
+
+#define UNUSED(x) do {(void)(x);} while (0)
+
+// 每隔这么多秒采样一次各 worker 的吞吐量
+#define RATE_INTERVAL 1.0
+
+// EWMA 中新样本的权重
+#define ALPHA 0.5
+
+// 一个以这么多字节/秒转发数据的 worker，负载相当于多一个连接
+#define BYTES_PER_CONN (1024.0 * 1024.0)
+
+typedef struct
+{
+	int id;
+	struct ev_loop *loop;
+	ev_async w_async;
+	mpsc_t queue;
+	unsigned long pending;		// 交给它、尚未进入 relay 的连接，两个线程都会修改
+	relay_load_t *load;			// 由 worker 线程更新
+	uint64_t bytes;				// 以下只在主事件循环中使用
+	double rate;
+	unsigned long dispatched;
+} worker_loop_t;
+
+static void *loop_main(void *arg);
+static void async_cb(EV_P_ ev_async *w, int revents);
+static void rate_cb(EV_P_ ev_timer *w, int revents);
+static void stats_cb(EV_P_ ev_signal *w, int revents);
+
+extern __thread struct ev_loop *loop;
+
+static worker_loop_t *loops = NULL;
+static int loop_num = 0;
+static int cursor = 0;
+static int (*loop_init)(void);
+static void (*handler)(EV_P_ mpsc_node_t *node);
+static __thread worker_loop_t *self = NULL;
+static ev_timer w_rate;
+static ev_signal w_stats;
+
+// 等待 worker 线程完成初始化
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+static int ready = 0;
+static int failed = 0;
+
+int dispatch_init(int n, int (*init)(void), void (*cb)(EV_P_ mpsc_node_t *node))
+{
+	loops = (worker_loop_t *)calloc(n, sizeof(worker_loop_t));
+	if (loops == NULL)
+	{
+		LOG("out of memory");
+		return -1;
+	}
+	loop_num = n;
+	loop_init = init;
+	handler = cb;
+
+	// worker 线程屏蔽所有信号，信号只由主事件循环处理
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (int i = 0; i < n; i++)
+	{
+		loops[i].id = i + 1;
+		mpsc_init(&(loops[i].queue));
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, loop_main, &loops[i]) != 0)
+		{
+			ERROR("pthread_create");
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+			return -1;
+		}
+		pthread_detach(tid);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	pthread_mutex_lock(&ready_lock);
+	while (ready + failed < n)
+	{
+		pthread_cond_wait(&ready_cond, &ready_lock);
+	}
+	pthread_mutex_unlock(&ready_lock);
+	if (failed > 0)
+	{
+		return -1;
+	}
+
+	ev_timer_init(&w_rate, rate_cb, RATE_INTERVAL, RATE_INTERVAL);
+	ev_timer_start(EV_A_ &w_rate);
+	ev_signal_init(&w_stats, stats_cb, SIGUSR1);
+	ev_signal_start(EV_A_ &w_stats);
+	LOG("dispatching connections to %d worker loops", n);
+	return 0;
+}
+
+static void *loop_main(void *arg)
+{
+	worker_loop_t *l = (worker_loop_t *)arg;
+	self = l;
+	loop = ev_loop_new(EVFLAG_AUTO);
+	int ok = 0;
+	if (loop == NULL)
+	{
+		LOG("failed to create event loop");
+	}
+	else
+	{
+		l->loop = loop;
+		ev_async_init(&(l->w_async), async_cb);
+		ev_async_start(EV_A_ &(l->w_async));
+		profile_loop();
+		ok = (loop_init() == 0);
+		l->load = relay_load();
+	}
+
+	pthread_mutex_lock(&ready_lock);
+	if (ok)
+	{
+		ready++;
+	}
+	else
+	{
+		failed++;
+	}
+	pthread_cond_signal(&ready_cond);
+	pthread_mutex_unlock(&ready_lock);
+
+	if (ok)
+	{
+		ev_run(EV_A_ 0);
+	}
+	return NULL;
+}
+
+static double score(const worker_loop_t *l)
+{
+	unsigned long pending = __atomic_load_n(&(l->pending), __ATOMIC_RELAXED);
+	unsigned long active = __atomic_load_n(&(l->load->active), __ATOMIC_RELAXED);
+	return (double)pending + (double)active + l->rate / BYTES_PER_CONN;
+}
+
+void dispatch(mpsc_node_t *node)
+{
+	// 从上次选中的下一个开始比较，负载相同时轮流分配
+	worker_loop_t *best = &loops[cursor];
+	double min = score(best);
+	for (int i = 1; i < loop_num; i++)
+	{
+		worker_loop_t *l = &loops[(cursor + i) % loop_num];
+		double s = score(l);
+		if (s < min)
+		{
+			best = l;
+			min = s;
+		}
+	}
+	cursor = best->id % loop_num;
+	best->dispatched++;
+	__atomic_add_fetch(&(best->pending), 1, __ATOMIC_RELAXED);
+	mpsc_push(&(best->queue), node);
+	ev_async_send(best->loop, &(best->w_async));
+}
+
+void dispatch_done(void)
+{
+	if (self != NULL)
+	{
+		__atomic_sub_fetch(&(self->pending), 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void async_cb(EV_P_ ev_async *w, int revents)
+{
+	UNUSED(w);
+	UNUSED(revents);
+
+	mpsc_node_t *node = mpsc_pop_all(&(self->queue));
+	while (node != NULL)
+	{
+		mpsc_node_t *next = node->next;
+		handler(EV_A_ node);
+		node = next;
+	}
+}
+
+static void rate_cb(EV_P_ ev_timer *w, int revents)
+{
+	UNUSED(loop);
+	UNUSED(w);
+	UNUSED(revents);
+
+	for (int i = 0; i < loop_num; i++)
+	{
+		worker_loop_t *l = &loops[i];
+		uint64_t bytes = __atomic_load_n(&(l->load->bytes), __ATOMIC_RELAXED);
+		l->rate += ALPHA * ((bytes - l->bytes) / RATE_INTERVAL - l->rate);
+		l->bytes = bytes;
+	}
+}
+
+static void stats_cb(EV_P_ ev_signal *w, int revents)
+{
+	UNUSED(loop);
+	UNUSED(w);
+	UNUSED(revents);
+
+	for (int i = 0; i < loop_num; i++)
+	{
+		worker_loop_t *l = &loops[i];
+		LOG("loop %d: %lu connections dispatched, %lu setting up, %lu relaying, %.0f KB/s",
+		    l->id, l->dispatched, __atomic_load_n(&(l->pending), __ATOMIC_RELAXED),
+		    __atomic_load_n(&(l->load->active), __ATOMIC_RELAXED), l->rate / 1024);
+	}
+}
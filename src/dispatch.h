@@ -0,0 +1,37 @@
+/*
+ * dispatch.h - hand connections to the least loaded worker loop
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <ev.h>
+#include "mpsc.h"
+
+// 启动 n 个 worker 线程，每个线程运行自己的事件循环，
+// init 在每个 worker 线程中调用一次，cb 在 worker 线程中处理交给它的连接
+extern int dispatch_init(int n, int (*init)(void), void (*cb)(EV_P_ mpsc_node_t *node));
+
+// 在主事件循环中调用，把连接交给负载最低的 worker
+extern void dispatch(mpsc_node_t *node);
+
+// 在 worker 线程中调用，交给它的连接已经结束或者已经交给 relay，
+// 不在 worker 线程中时什么也不做
+extern void dispatch_done(void);
+
+#endif // DISPATCH_H
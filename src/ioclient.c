@@ -34,17 +34,29 @@
 #include "async_connect.h"
 #include "conf.h"
 #include "crypto.h"
+#include "csprng.h"
+#include "iosocks.h"
 #include "log.h"
 #include "md5.h"
+#include "pending.h"
+#include "probes.h"
+#include "profile.h"
 #include "relay.h"
 #include "socks5.h"
+#include "telemetry.h"
+#include "trace.h"
 #include "utils.h"
+#include "watchdog.h"
 
 #define UNUSED(x) do {(void)(x);} while (0)
 
 // 最大连接尝试次数
 #define MAX_TRY 4
 
+// 没有可用 server 时最多排队等待的请求数和等待时间
+#define MAX_PENDING 256
+#define PENDING_TIMEOUT 15.0
+
 #ifndef EAGAIN
 #  define EAGAIN EWOULDBLOCK
 #endif
@@ -52,8 +64,9 @@
 #  define EWOULDBLOCK EAGAIN
 #endif
 
-typedef struct
+typedef struct ctx
 {
+	pending_t pending;	// 没有可用 server 时排队
 	int sock_local;
 	int sock_remote;
 	int server_id;
@@ -63,20 +76,26 @@ typedef struct
 	crypto_evp_t evp;
 	ev_io w_write;
 	ssize_t len;
-	uint8_t buf[16 + 257 + 15];
+	ssize_t offset;
+	trace_t *trace;
+	uint8_t buf[IOSOCKS_MAX_LEN + IOSOCKS_EARLY_LEN];
 } ctx_t;
 
 static void timer_cb(EV_P_ ev_timer *w, int revents);
 static void signal_cb(EV_P_ ev_signal *w, int revents);
 static void accept_cb(EV_P_ ev_io *w, int revents);
-static void socks5_cb(int sock, char *host, char *port);
+static void socks5_cb(int sock, char *host, char *port, double start);
 static void connect_cb(int sock, void *data);
+static void probe_cb(int sock, void *data);
 static void iosocks_send_cb(EV_P_ ev_io *w, int revents);
 static int  select_server(void);
 static void connect_server(ctx_t *ctx);
+static int  any_available(void);
+static void pending_connect(pending_t *p);
+static void pending_abort(pending_t *p);
 
 // ev loop
-struct ev_loop *loop;
+__thread struct ev_loop *loop;
 
 // 配置信息
 static conf_t conf;
@@ -87,7 +106,10 @@ static struct
 	struct sockaddr_storage addr;
 	socklen_t addrlen;
 	char *key;
+	int compact;
+	uint32_t uid;
 	time_t health;		// 0 可用，非 0 不可用
+	int probing;
 } servers[MAX_SERVER];
 
 int main(int argc, char **argv)
@@ -112,7 +134,10 @@ int main(int argc, char **argv)
 	for (int i = 0; i < conf.server_num; i++)
 	{
 		servers[i].health = 0;
+		servers[i].probing = 0;
 		servers[i].key = conf.server[i].key;
+		servers[i].compact = conf.server[i].compact;
+		servers[i].uid = conf.server[i].uid;
 		bzero(&hints, sizeof(struct addrinfo));
 		hints.ai_family = AF_UNSPEC;
 		hints.ai_socktype = SOCK_STREAM;
@@ -157,18 +182,34 @@ int main(int argc, char **argv)
 
 	// 初始化 ev
 	loop = EV_DEFAULT;
+	if (watchdog_init(conf.watchdog) != 0)
+	{
+		return EXIT_FAILURE;
+	}
 	ev_signal w_sigint;
 	ev_signal w_sigterm;
 	ev_signal_init(&w_sigint, signal_cb, SIGINT);
 	ev_signal_init(&w_sigterm, signal_cb, SIGTERM);
 	ev_signal_start(EV_A_ &w_sigint);
 	ev_signal_start(EV_A_ &w_sigterm);
+	profile_init();
+	if (relay_init(conf.edge, conf.crypto_threads, conf.coalesce,
+	               conf.buffer_max * 1024) != 0)
+	{
+		return EXIT_FAILURE;
+	}
+	if (trace_init(conf.trace, conf.trace_sample) != 0)
+	{
+		return EXIT_FAILURE;
+	}
+	telemetry_init(&conf);
 	ev_io w_listen;
 	ev_io_init(&w_listen, accept_cb, sock_listen, EV_READ);
 	ev_io_start(EV_A_ &w_listen);
 	ev_timer w_timer;
 	ev_timer_init(&w_timer, timer_cb, 5.0, 5.0);
 	ev_timer_start(EV_A_ &w_timer);
+	pending_init(MAX_PENDING, PENDING_TIMEOUT, any_available, pending_connect, pending_abort);
 
 	// drop root privilege
 	if (runas(conf.user) != 0)
@@ -201,7 +242,63 @@ static void timer_cb(EV_P_ ev_timer *w, int revents)
 		{
 			servers[i].health = 0;
 		}
+		else if (!pending_empty() && !servers[i].probing)
+		{
+			// 有请求在排队时提前探测不可用的 server
+			servers[i].probing = 1;
+			async_connect((struct sockaddr *)&servers[i].addr,
+			              servers[i].addrlen, probe_cb, (void *)(intptr_t)i);
+		}
+	}
+	pending_dispatch();
+}
+
+static void probe_cb(int sock, void *data)
+{
+	int id = (int)(intptr_t)data;
+
+	servers[id].probing = 0;
+	if (sock > 0)
+	{
+		close(sock);
+		LOG("%s:%s is back", conf.server[id].address, conf.server[id].port);
+		servers[id].health = 0;
+		pending_dispatch();
+	}
+	else
+	{
+		servers[id].health = time(NULL);
+	}
+}
+
+static int any_available(void)
+{
+	for (int i = 0; i < conf.server_num; i++)
+	{
+		if (servers[i].health == 0)
+		{
+			return 1;
+		}
 	}
+	return 0;
+}
+
+// 有 server 可用，重新分派排队的请求
+static void pending_connect(pending_t *p)
+{
+	ctx_t *ctx = (ctx_t *)p;
+	trace_span(ctx->trace, "pending", NULL);
+	connect_server(ctx);
+}
+
+// 排队超时或者队列已满
+static void pending_abort(pending_t *p)
+{
+	ctx_t *ctx = (ctx_t *)p;
+	LOG("no available server, abort");
+	close(ctx->sock_local);
+	trace_close(ctx->trace);
+	free(ctx);
 }
 
 static void signal_cb(EV_P_ ev_signal *w, int revents)
@@ -227,11 +324,12 @@ static void accept_cb(EV_P_ ev_io *w, int revents)
 		setnonblock(sock);
 		settimeout(sock);
 		setkeepalive(sock);
+		PROBE1(accept, sock);
 		socks5_accept(sock, socks5_cb);
 	}
 }
 
-void socks5_cb(int sock, char *host, char *port)
+void socks5_cb(int sock, char *host, char *port, double start)
 {
 	ctx_t *ctx = (ctx_t *)malloc(sizeof(ctx_t));
 	if (ctx == NULL)
@@ -244,6 +342,9 @@ void socks5_cb(int sock, char *host, char *port)
 	strcpy(ctx->host, host);
 	strcpy(ctx->port, port);
 	ctx->server_tried = 0;
+	ctx->pending.deadline = 0.0;
+	ctx->trace = trace_new(start);
+	trace_span(ctx->trace, "socks5", ctx->host);
 	connect_server(ctx);
 }
 
@@ -253,18 +354,19 @@ static void connect_server(ctx_t *ctx)
 	ctx->server_id = select_server();
 	if (ctx->server_id < 0)
 	{
-		LOG("no available server, abort");
-		close(ctx->sock_local);
-		free(ctx);
+		// 排队等待 server 恢复
+		pending_push(&(ctx->pending));
 		return;
 	}
 	ctx->server_tried++;
+	trace_span(ctx->trace, "select server", conf.server[ctx->server_id].address);
 	LOG("connect %s:%s via %s:%s",
 	    ctx->host, ctx->port,
 	    conf.server[ctx->server_id].address,
 	    conf.server[ctx->server_id].port);
 
 	// 建立远程连接
+	PROBE2(connect_start, ctx->sock_local, ctx->server_id);
 	async_connect((struct sockaddr *)&servers[ctx->server_id].addr,
 	              servers[ctx->server_id].addrlen, connect_cb, ctx);
 }
@@ -275,61 +377,58 @@ static void connect_cb(int sock, void *data)
 
 	assert(ctx != NULL);
 
+	PROBE3(connect_end, ctx->sock_local, ctx->server_id, sock > 0);
 	if (sock > 0)
 	{
 		// 连接成功
 		ctx->sock_remote = sock;
+		trace_span(ctx->trace, "connect ioserver", "ok");
+		pending_dispatch();
+
+		ctx->len = iosocks_request(ctx->buf, ctx->host, ctx->port,
+		                           servers[ctx->server_id].compact,
+		                           servers[ctx->server_id].uid,
+		                           servers[ctx->server_id].key, &(ctx->evp));
 
-		// IoSocks Request
-		// +------+------+------+
-		// |  IV  | HOST | PORT |
-		// +------+------+------+
-		// |  16  | 257  |  15  |
-		// +------+------+------+
-		bzero(ctx->buf, 16 + 257 + 15);
-		strcpy((char *)ctx->buf + 16, ctx->host);
-		strcpy((char *)ctx->buf + 16 + 257, ctx->port);
-		md5(ctx->buf, ctx->buf + 16, 257 + 15);
-		crypto_init(&(ctx->evp), servers[ctx->server_id].key, ctx->buf);
-		crypto_encrypt(ctx->buf + 16, 257 + 15, &(ctx->evp));
-		ctx->len = 16 + 257 + 15;
-		ssize_t n = send(ctx->sock_remote, ctx->buf, ctx->len, MSG_NOSIGNAL);
-		if (n < 0)
+		// 客户端已经发出的数据与请求头合并在一起发送
+		ssize_t n = recv(ctx->sock_local, ctx->buf + ctx->len, IOSOCKS_EARLY_LEN, 0);
+		if (n > 0)
 		{
-			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
-			{
-				ev_io_init(&(ctx->w_write), iosocks_send_cb, ctx->sock_remote, EV_WRITE);
-				ctx->w_write.data = (void *)ctx;
-				ev_io_start(EV_A_ &ctx->w_write);
-			}
-			else
-			{
-				close(ctx->sock_local);
-				close(ctx->sock_remote);
-				free(ctx);
-			}
+			crypto_encrypt(ctx->buf + ctx->len, n, &(ctx->evp));
+			ctx->len += n;
 		}
-		else
+		else if ((n == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
 		{
-			relay(ctx->sock_local, ctx->sock_remote, &(ctx->evp));
+			if (n < 0)
+			{
+				LOG("client reset");
+			}
+			close(ctx->sock_local);
+			close(ctx->sock_remote);
+			trace_close(ctx->trace);
 			free(ctx);
+			return;
 		}
+		ctx->offset = 0;
+		ev_io_init(&(ctx->w_write), iosocks_send_cb, ctx->sock_remote, EV_WRITE);
+		ctx->w_write.data = (void *)ctx;
+		iosocks_send_cb(EV_A_ &(ctx->w_write), EV_WRITE);
 	}
 	else
 	{
 		// 连接失败
 		servers[ctx->server_id].health = time(NULL);
+		trace_span(ctx->trace, "connect ioserver", "failed");
 		if (ctx->server_tried < MAX_TRY)
 		{
 			LOG("connect to ioserver failed, try again");
-			close(ctx->sock_remote);
 			connect_server(ctx);
 		}
 		else
 		{
 			LOG("connect to ioserver failed, abort");
 			close(ctx->sock_local);
-			close(ctx->sock_remote);
+			trace_close(ctx->trace);
 			free(ctx);
 		}
 	}
@@ -342,36 +441,74 @@ static void iosocks_send_cb(EV_P_ ev_io *w, int revents)
 	UNUSED(revents);
 	assert(ctx != NULL);
 
-	ev_io_stop(EV_A_ w);
-
-	ssize_t n = send(ctx->sock_remote, ctx->buf, ctx->len, MSG_NOSIGNAL);
+	ssize_t n = send(ctx->sock_remote, ctx->buf + ctx->offset,
+	                 ctx->len - ctx->offset, MSG_NOSIGNAL);
 	if (n < 0)
 	{
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+		{
+			ev_io_start(EV_A_ w);
+			return;
+		}
+		ERROR("send");
+		ev_io_stop(EV_A_ w);
 		close(ctx->sock_local);
 		close(ctx->sock_remote);
+		trace_close(ctx->trace);
 		free(ctx);
 		return;
 	}
-	else
+	ctx->offset += n;
+	if (ctx->offset < ctx->len)
 	{
-		relay(ctx->sock_local, ctx->sock_remote, &(ctx->evp));
-		free(ctx);
+		ev_io_start(EV_A_ w);
+		return;
 	}
+	ev_io_stop(EV_A_ w);
+	trace_span(ctx->trace, "iosocks request", NULL);
+	relay(ctx->sock_local, ctx->sock_remote, ctx->server_id,
+	      &(ctx->evp), NULL, 0, ctx->trace);
+	free(ctx);
 }
 
 static int select_server(void)
 {
-	unsigned char rand_num;
-	int id;
+	// 可用 server 的位图，路径质量只与可用的 server 相比
+	unsigned healthy = 0;
+	int num = 0;
+	for (int i = 0; i < conf.server_num; i++)
+	{
+		if (servers[i].health == 0)
+		{
+			healthy |= 1u << i;
+			num++;
+		}
+	}
+	if (num == 0)
+	{
+		return -1;
+	}
+	unsigned char rand_num[2];
 	int tries = 0;
 	while (tries++ < 100)
 	{
-		rand_bytes(&rand_num, sizeof(unsigned char));
-		id = (int)rand_num % conf.server_num;
-		if (servers[id].health == 0)
+		rand_bytes(rand_num, sizeof(rand_num));
+		int id = (int)rand_num[0] % conf.server_num;
+		// 路径质量较差的 server 按权重降低被选中的概率
+		if ((healthy & (1u << id)) && (rand_num[1] < telemetry_weight(id, healthy) * 256))
 		{
 			return id;
 		}
 	}
+	// 按权重没有选中，在可用的 server 中均匀选择一个
+	rand_bytes(rand_num, 1);
+	int k = (int)rand_num[0] % num;
+	for (int i = 0; i < conf.server_num; i++)
+	{
+		if ((healthy & (1u << i)) && (k-- == 0))
+		{
+			return i;
+		}
+	}
 	return -1;
 }
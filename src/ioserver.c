@@ -34,44 +34,82 @@
 #include <unistd.h>
 #include "async_connect.h"
 #include "async_resolv.h"
+#include "breaker.h"
 #include "conf.h"
 #include "crypto.h"
+#include "dispatch.h"
+#include "iosocks.h"
 #include "log.h"
 #include "md5.h"
+#include "probes.h"
+#include "profile.h"
 #include "relay.h"
+#include "trace.h"
+#include "users.h"
 #include "utils.h"
+#include "watchdog.h"
 
 #define UNUSED(x) do {(void)(x);} while (0)
 
+// 握手超时时间
+#define HANDSHAKE_TIMEOUT 10.0
+
+#ifndef EAGAIN
+#  define EAGAIN EWOULDBLOCK
+#endif
+#ifndef EWOULDBLOCK
+#  define EWOULDBLOCK EAGAIN
+#endif
+
 // 连接控制块
 typedef struct
 {
+	mpsc_node_t node;	// 交给 worker 事件循环时使用
 	int sock;
 	int server_id;
 	struct addrinfo *_res;
 	struct addrinfo *res;
 	ev_io w_read;
+	ev_timer w_timeout;
 	crypto_evp_t evp;
+	ssize_t hdr_len;
+	ssize_t len;
+	size_t sent;		// 随 SYN 发给目标的字节数
+	trace_t *trace;
+	char host[257];
+	char port[15];
+	uint8_t buf[IOSOCKS_MAX_LEN + IOSOCKS_EARLY_LEN];
 } ctx_t;
 
 static void signal_cb(EV_P_ ev_signal *w, int revents);
+static void reload_cb(EV_P_ ev_signal *w, int revents);
 static void accept_cb(EV_P_ ev_io *w, int revents);
 static void iosocks_recv_cb(EV_P_ ev_io *w, int revents);
+static ssize_t handshake(int server_id, uint8_t *buf, ssize_t start, ssize_t len,
+                         crypto_evp_t *evp, char *host, char *port);
+static void timeout_cb(EV_P_ ev_timer *w, int revents);
+static void handshake_abort(EV_P_ ctx_t *ctx);
+static void request(ctx_t *ctx, const char *host, const char *port);
+static void dispatch_cb(EV_P_ mpsc_node_t *node);
+static int  loop_init(void);
 static void resolv_cb(struct addrinfo *res, void *data);
+static int  connect_next(ctx_t *ctx);
 static void connect_cb(int sock, void *data);
 
+// 配置信息
+static conf_t conf;
+
 // 服务器的信息
 static struct
 {
 	char *key;
+	users_t *users;		// 非 NULL 表示多用户模式
 } servers[MAX_SERVER];
 
-struct ev_loop *loop;
+__thread struct ev_loop *loop;
 
 int main(int argc, char **argv)
 {
-	conf_t conf;
-
 	if (parse_args(argc, argv, &conf) != 0)
 	{
 		return EXIT_FAILURE;
@@ -90,16 +128,54 @@ int main(int argc, char **argv)
 	for (int i = 0; i < conf.server_num; i++)
 	{
 		servers[i].key = conf.server[i].key;
+		servers[i].users = NULL;
+		if (conf.server[i].users[0] != '\0')
+		{
+			servers[i].users = users_load(conf.server[i].users);
+			if (servers[i].users == NULL)
+			{
+				return EXIT_FAILURE;
+			}
+			LOG("loaded %zu users from %s",
+			    users_count(servers[i].users), conf.server[i].users);
+		}
 	}
 
 	// 初始化 ev_signal
 	loop = EV_DEFAULT;
+	if (watchdog_init(conf.watchdog) != 0)
+	{
+		return EXIT_FAILURE;
+	}
 	ev_signal w_sigint;
 	ev_signal w_sigterm;
 	ev_signal_init(&w_sigint, signal_cb, SIGINT);
 	ev_signal_init(&w_sigterm, signal_cb, SIGTERM);
 	ev_signal_start(EV_A_ &w_sigint);
 	ev_signal_start(EV_A_ &w_sigterm);
+	profile_init();
+	if ((conf.loops > 0) && (conf.crypto_threads > 0))
+	{
+		// crypto worker 线程只能把结果交回主事件循环
+		LOG("crypto_threads is ignored when loops is set");
+		conf.crypto_threads = 0;
+	}
+	if (relay_init(conf.edge, conf.crypto_threads, conf.coalesce,
+	               conf.buffer_max * 1024) != 0)
+	{
+		return EXIT_FAILURE;
+	}
+	if (trace_init(conf.trace, conf.trace_sample) != 0)
+	{
+		return EXIT_FAILURE;
+	}
+	if (breaker_init(conf.breaker, conf.breaker_cooldown) != 0)
+	{
+		return EXIT_FAILURE;
+	}
+	ev_signal w_sighup;
+	ev_signal_init(&w_sighup, reload_cb, SIGHUP);
+	ev_signal_start(EV_A_ &w_sighup);
 
 	// 初始化本地监听 socket
 	int sock_listen[conf.server_num];
@@ -124,6 +200,7 @@ int main(int argc, char **argv)
 		}
 		setnonblock(sock_listen[i]);
 		setreuseaddr(sock_listen[i]);
+		setdeferaccept(sock_listen[i]);
 		if (bind(sock_listen[i], (struct sockaddr *)res->ai_addr, res->ai_addrlen) != 0)
 		{
 			ERROR("bind");
@@ -147,6 +224,12 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	// 主事件循环只接受连接、验证请求头，之后的工作交给 worker 事件循环
+	if ((conf.loops > 0) && (dispatch_init(conf.loops, loop_init, dispatch_cb) != 0))
+	{
+		return EXIT_FAILURE;
+	}
+
 	// drop root privilege
 	if (runas(conf.user) != 0)
 	{
@@ -160,6 +243,7 @@ int main(int argc, char **argv)
 	for (int i = 0; i < conf.server_num; i++)
 	{
 		close(sock_listen[i]);
+		users_free(servers[i].users);
 	}
 	LOG("Exit");
 
@@ -173,30 +257,105 @@ static void signal_cb(EV_P_ ev_signal *w, int revents)
 	ev_break(EV_A_ EVBREAK_ALL);
 }
 
+static void reload_cb(EV_P_ ev_signal *w, int revents)
+{
+	UNUSED(loop);
+	UNUSED(revents);
+	assert(w->signum == SIGHUP);
+
+	// 重新加载多用户密钥文件，失败时继续使用原来的
+	for (int i = 0; i < conf.server_num; i++)
+	{
+		if (servers[i].users == NULL)
+		{
+			continue;
+		}
+		users_t *users = users_load(conf.server[i].users);
+		if (users != NULL)
+		{
+			users_free(servers[i].users);
+			servers[i].users = users;
+			LOG("reloaded %zu users from %s",
+			    users_count(users), conf.server[i].users);
+		}
+	}
+}
+
 static void accept_cb(EV_P_ ev_io *w, int revents)
 {
 	UNUSED(revents);
 
+	int sock = accept(w->fd, NULL, NULL);
+	if (sock < 0)
+	{
+		ERROR("accept");
+		return;
+	}
+	double start = ev_time();
+	setnonblock(sock);
+	settimeout(sock);
+	setkeepalive(sock);
+	int server_id = (int)(uintptr_t)(w->data);
+	PROBE2(accept, sock, server_id);
+
+	// 监听 socket 设置了 TCP_DEFER_ACCEPT，通常请求头已经到达，
+	// 直接在这里验证，验证通过后再分配连接控制块
+	uint8_t buf[IOSOCKS_MAX_LEN + IOSOCKS_EARLY_LEN];
+	ssize_t n = recv(sock, buf, sizeof(buf), 0);
+	if (n <= 0)
+	{
+		if (n == 0)
+		{
+			close(sock);
+			return;
+		}
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+		{
+			ERROR("recv");
+			close(sock);
+			return;
+		}
+		n = 0;
+	}
+	crypto_evp_t evp;
+	char host[257];
+	char port[15];
+	ssize_t hdr_len = handshake(server_id, buf, 0, n, &evp, host, port);
+	if (hdr_len < 0)
+	{
+		PROBE3(handshake, sock, server_id, 0);
+		LOG("illegal client");
+		close(sock);
+		return;
+	}
+
 	ctx_t *ctx = (ctx_t *)malloc(sizeof(ctx_t));
 	if (ctx == NULL)
 	{
 		LOG("out of memory");
+		close(sock);
 		return;
 	}
-	ctx->sock = accept(w->fd, NULL, NULL);
-	if (ctx->sock < 0)
+	ctx->sock = sock;
+	ctx->server_id = server_id;
+	ctx->evp = evp;
+	ctx->hdr_len = hdr_len;
+	ctx->len = n;
+	memcpy(ctx->buf, buf, n);
+	ctx->trace = trace_new(start);
+	if (hdr_len > 0)
 	{
-		ERROR("accept");
-		free(ctx);
+		request(ctx, host, port);
 		return;
 	}
-	setnonblock(ctx->sock);
-	settimeout(ctx->sock);
-	setkeepalive(ctx->sock);
-	ctx->server_id = (int)(uintptr_t)(w->data);
+
+	// 请求头不完整，等待剩余部分
 	ev_io_init(&ctx->w_read, iosocks_recv_cb, ctx->sock, EV_READ);
+	ev_timer_init(&ctx->w_timeout, timeout_cb, HANDSHAKE_TIMEOUT, 0);
 	ctx->w_read.data = (void *)ctx;
+	ctx->w_timeout.data = (void *)ctx;
 	ev_io_start(EV_A_ &ctx->w_read);
+	ev_timer_start(EV_A_ &ctx->w_timeout);
 }
 
 static void iosocks_recv_cb(EV_P_ ev_io *w, int revents)
@@ -206,101 +365,236 @@ static void iosocks_recv_cb(EV_P_ ev_io *w, int revents)
 
 	ctx_t *ctx = (ctx_t *)(w->data);
 
-	ev_io_stop(EV_A_ w);
-
-	uint8_t buf[288];
-	ssize_t n = recv(ctx->sock, buf, sizeof(buf), 0);
-	if (n != 288)
+	// 请求头可能分多次到达，收齐之前保持 w_read
+	ssize_t n = recv(ctx->sock, ctx->buf + ctx->len, sizeof(ctx->buf) - ctx->len, 0);
+	if (n <= 0)
 	{
 		if (n < 0)
 		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				return;
+			}
 			ERROR("recv");
 		}
 		else
 		{
 			LOG("bad client");
 		}
-		close(ctx->sock);
-		free(ctx);
+		handshake_abort(EV_A_ ctx);
 		return;
 	}
 
-	// IoSocks Request
-	// +------+------+------+
-	// |  IV  | HOST | PORT |
-	// +------+------+------+
-	// |  16  | 257  |  15  |
-	// +------+------+------+
-	crypto_init(&(ctx->evp), servers[ctx->server_id].key, buf);
-	crypto_decrypt(buf + 16, 257 + 15, &(ctx->evp));
-	uint8_t tmp[16];
-	md5(tmp, buf + 16, 257 + 15);
-	if (memcmp(buf, tmp, 16) != 0)
+	char host[257];
+	char port[15];
+	ssize_t start = ctx->len;
+	ctx->len += n;
+	ctx->hdr_len = handshake(ctx->server_id, ctx->buf, start, ctx->len,
+	                         &(ctx->evp), host, port);
+	if (ctx->hdr_len == 0)
+	{
+		return;
+	}
+	else if (ctx->hdr_len < 0)
 	{
+		PROBE3(handshake, ctx->sock, ctx->server_id, 0);
 		LOG("illegal client");
-		close(ctx->sock);
-		free(ctx);
+		handshake_abort(EV_A_ ctx);
 		return;
 	}
-	char *host = (char *)(buf + 16);
-	char *port = (char *)(buf + 16 + 257);
-	host[256] = '\0';
-	port[14] = '\0';
+	ev_io_stop(EV_A_ &ctx->w_read);
+	ev_timer_stop(EV_A_ &ctx->w_timeout);
+	request(ctx, host, port);
+}
+
+// 请求头验证通过，开始解析域名
+static void request(ctx_t *ctx, const char *host, const char *port)
+{
+	PROBE3(handshake, ctx->sock, ctx->server_id, 1);
+	trace_span(ctx->trace, "handshake", host);
 	LOG("connect %s:%s", host, port);
+	if (conf.loops > 0)
+	{
+		strcpy(ctx->host, host);
+		strcpy(ctx->port, port);
+		dispatch(&(ctx->node));
+		return;
+	}
+	PROBE2(resolve_start, ctx->sock, host);
 	async_resolv(host, port, resolv_cb, ctx);
 }
 
+// 在 worker 事件循环中继续处理
+static void dispatch_cb(EV_P_ mpsc_node_t *node)
+{
+	UNUSED(loop);
+
+	ctx_t *ctx = (ctx_t *)node;
+	PROBE2(resolve_start, ctx->sock, ctx->host);
+	async_resolv(ctx->host, ctx->port, resolv_cb, ctx);
+}
+
+// 在每个 worker 线程中调用
+static int loop_init(void)
+{
+	if (relay_loop_init() != 0)
+	{
+		return -1;
+	}
+	return resolv_init();
+}
+
+// 处理 buf 中 [start, len) 新收到的数据，返回值同 iosocks_parse
+// 收齐 IV 后初始化加密，之后只解密新收到的数据
+// 请求头之后的数据为客户端提前发送的数据，一并解密
+static ssize_t handshake(int server_id, uint8_t *buf, ssize_t start, ssize_t len,
+                         crypto_evp_t *evp, char *host, char *port)
+{
+	// 多用户模式下 IV 之后是明文的用户 ID，据此查找密钥
+	int multi = (servers[server_id].users != NULL);
+	ssize_t off = multi ? IOSOCKS_IV_LEN + IOSOCKS_UID_LEN : IOSOCKS_IV_LEN;
+	if (len < off)
+	{
+		return 0;
+	}
+	const void *key = servers[server_id].key;
+	if (multi)
+	{
+		uint32_t uid;
+		memcpy(&uid, buf + IOSOCKS_IV_LEN, IOSOCKS_UID_LEN);
+		key = users_key(servers[server_id].users, ntohl(uid));
+		if (key == NULL)
+		{
+			return -1;
+		}
+	}
+	if (start < off)
+	{
+		crypto_init(evp, key, buf);
+		start = off;
+	}
+	crypto_decrypt(buf + start, len - start, evp);
+	return iosocks_parse(buf, len, multi, key, host, port);
+}
+
+static void timeout_cb(EV_P_ ev_timer *w, int revents)
+{
+	ctx_t *ctx = (ctx_t *)(w->data);
+
+	UNUSED(revents);
+	assert(ctx != NULL);
+
+	LOG("handshake timeout");
+	handshake_abort(EV_A_ ctx);
+}
+
+static void handshake_abort(EV_P_ ctx_t *ctx)
+{
+	ev_io_stop(EV_A_ &ctx->w_read);
+	ev_timer_stop(EV_A_ &ctx->w_timeout);
+	close(ctx->sock);
+	trace_span(ctx->trace, "handshake", "failed");
+	trace_close(ctx->trace);
+	free(ctx);
+}
+
 static void resolv_cb(struct addrinfo *res, void *data)
 {
 	assert(data != NULL);
 
 	ctx_t *ctx = (ctx_t *)data;
 
+	PROBE2(resolve_end, ctx->sock, res != NULL);
+	trace_span(ctx->trace, "resolve", (res != NULL) ? "ok" : "failed");
 	if (res != NULL)
 	{
 		// 域名解析成功，建立远程连接
 		ctx->_res = res;
 		ctx->res = res;
-		async_connect(ctx->res->ai_addr, ctx->res->ai_addrlen, connect_cb, data);
+		if (connect_next(ctx) != 0)
+		{
+			// 所有地址的断路器都处于打开状态
+			LOG("destination is down, abort");
+			trace_span(ctx->trace, "connect", "circuit open");
+			close(ctx->sock);
+			freeaddrinfo(ctx->_res);
+			trace_close(ctx->trace);
+			free(ctx);
+			dispatch_done();
+		}
 	}
 	else
 	{
 		// 域名解析失败
 		close(ctx->sock);
+		trace_close(ctx->trace);
 		free(ctx);
+		dispatch_done();
 	}
 }
 
+// 从 ctx->res 开始跳过断路器打开的地址，连接第一个可用的地址
+// 没有可用的地址返回 -1
+static int connect_next(ctx_t *ctx)
+{
+	while ((ctx->res != NULL) && !breaker_allow(ctx->res->ai_addr))
+	{
+		ctx->res = ctx->res->ai_next;
+	}
+	if (ctx->res == NULL)
+	{
+		return -1;
+	}
+	PROBE3(connect_start, ctx->sock, ctx->server_id, ctx->res->ai_family);
+	ctx->sent = 0;
+	if (conf.fastopen)
+	{
+		// 客户端提前发送的数据随 SYN 一起发给目标
+		ctx->sent = ctx->len - ctx->hdr_len;
+		async_fastopen(ctx->res->ai_addr, ctx->res->ai_addrlen,
+		               ctx->buf + ctx->hdr_len, &(ctx->sent), connect_cb, ctx);
+	}
+	else
+	{
+		async_connect(ctx->res->ai_addr, ctx->res->ai_addrlen, connect_cb, ctx);
+	}
+	return 0;
+}
+
 static void connect_cb(int sock, void *data)
 {
 	ctx_t *ctx = (ctx_t *)(data);
 
 	assert(ctx != NULL);
 
+	PROBE4(connect_end, ctx->sock, ctx->server_id, sock > 0, ctx->res->ai_family);
+	trace_span(ctx->trace, "connect",
+	           (sock > 0) ? ((ctx->sent > 0) ? "fastopen" : "ok") : "failed");
 	if (sock > 0)
 	{
 		// 连接成功
+		breaker_report(ctx->res->ai_addr, 1);
 		freeaddrinfo(ctx->_res);
-		relay(sock, ctx->sock, &(ctx->evp));
+		relay(sock, ctx->sock, ctx->server_id, &(ctx->evp),
+		      ctx->buf + ctx->hdr_len + ctx->sent,
+		      ctx->len - ctx->hdr_len - ctx->sent, ctx->trace);
 		free(ctx);
+		dispatch_done();
 	}
 	else
 	{
-		// 连接失败
-		close(ctx->sock);
+		// 连接失败，尝试连接下一个地址
+		breaker_report(ctx->res->ai_addr, 0);
 		ctx->res = ctx->res->ai_next;
-		if (ctx->res != NULL)
-		{
-			// 尝试连接下一个地址
-			async_connect(ctx->res->ai_addr, ctx->res->ai_addrlen, connect_cb, data);
-		}
-		else
+		if (connect_next(ctx) != 0)
 		{
 			// 所有地址均连接失败
 			LOG("connect failed");
 			close(ctx->sock);
 			freeaddrinfo(ctx->_res);
+			trace_close(ctx->trace);
 			free(ctx);
+			dispatch_done();
 		}
 	}
 }
@@ -0,0 +1,215 @@
+/*
+ * iosocks.c - IoSocks Protocol
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "crypto.h"
+#include "csprng.h"
+#include "iosocks.h"
+#include "md5.h"
+#include "utils.h"
+
+// 地址类型，与 SOCKS5 相同
+#define ATYP_IPV4   0x01
+#define ATYP_DOMAIN 0x03
+#define ATYP_IPV6   0x04
+
+// MAC = MD5(IV + KEY + 请求头明文) 的前 IOSOCKS_MAC_LEN 字节
+static void mac(uint8_t *digest, const uint8_t *iv, const void *key,
+                const uint8_t *hdr, size_t len)
+{
+	uint8_t buf[16 + 16 + 2 + 256 + 2];
+	memcpy(buf, iv, 16);
+	memcpy(buf + 16, key, 16);
+	memcpy(buf + 32, hdr, len);
+	md5(digest, buf, 32 + len);
+}
+
+// uid 不为 0 时发送多用户请求头，总是使用紧凑格式
+size_t iosocks_request(uint8_t *buf, const char *host, const char *port,
+                       int compact, uint32_t uid,
+                       const void *key, crypto_evp_t *evp)
+{
+	if (!compact && (uid == 0))
+	{
+		// IoSocks Request
+		// +------+------+------+
+		// |  IV  | HOST | PORT |
+		// +------+------+------+
+		// |  16  | 257  |  15  |
+		// +------+------+------+
+		bzero(buf, IOSOCKS_LEGACY_LEN);
+		strcpy((char *)buf + 16, host);
+		strcpy((char *)buf + 16 + 257, port);
+		md5(buf, buf + 16, 257 + 15);
+		crypto_init(evp, key, buf);
+		crypto_encrypt(buf + 16, 257 + 15, evp);
+		return IOSOCKS_LEGACY_LEN;
+	}
+
+	// IoSocks Compact Request
+	// +------+-----+------+----------+------+-----+
+	// |  IV  | VER | ATYP |   ADDR   | PORT | MAC |
+	// +------+-----+------+----------+------+-----+
+	// |  16  |  1  |  1   | Variable |  2   |  4  |
+	// +------+-----+------+----------+------+-----+
+	// IV 之后的部分（从 VER 开始）全部加密传输，ADDR 为 4 字节 IPv4 地址、16 字节 IPv6 地址
+	// 或者 1 字节长度加域名
+	//
+	// IoSocks Multi-User Request
+	// +------+-----+-----+------+----------+------+-----+
+	// |  IV  | UID | VER | ATYP |   ADDR   | PORT | MAC |
+	// +------+-----+-----+------+----------+------+-----+
+	// |  16  |  4  |  1  |  1   | Variable |  2   |  4  |
+	// +------+-----+-----+------+----------+------+-----+
+	// UID 明文传输，服务器据此查找该用户的密钥，UID 之后的部分（从 VER 开始）全部加密传输
+	uint8_t *p = buf + 16;
+	if (uid != 0)
+	{
+		uint32_t uid_n = htonl(uid);
+		memcpy(p, &uid_n, IOSOCKS_UID_LEN);
+		p += IOSOCKS_UID_LEN;
+	}
+	size_t len;
+	p[0] = IOSOCKS_VERSION;
+	if (inet_pton(AF_INET, host, p + 2) == 1)
+	{
+		p[1] = ATYP_IPV4;
+		len = 2 + 4;
+	}
+	else if (inet_pton(AF_INET6, host, p + 2) == 1)
+	{
+		p[1] = ATYP_IPV6;
+		len = 2 + 16;
+	}
+	else
+	{
+		size_t host_len = strlen(host);
+		p[1] = ATYP_DOMAIN;
+		p[2] = (uint8_t)host_len;
+		memcpy(p + 3, host, host_len);
+		len = 3 + host_len;
+	}
+	uint16_t port_n = htons((uint16_t)strtoul(port, NULL, 10));
+	memcpy(p + len, &port_n, 2);
+	len += 2;
+
+	if (rand_bytes(buf, 16) != 16)
+	{
+		md5(buf, p, len);
+	}
+	uint8_t digest[16];
+	mac(digest, buf, key, p, len);
+	memcpy(p + len, digest, IOSOCKS_MAC_LEN);
+	len += IOSOCKS_MAC_LEN;
+
+	crypto_init(evp, key, buf);
+	crypto_encrypt(p, len, evp);
+	return (size_t)(p - buf) + len;
+}
+
+// buf 中 IV（和 UID）之后的部分必须已经解密，multi 表示多用户请求头
+// 返回请求头的长度，数据不完整返回 0，非法请求返回 -1
+ssize_t iosocks_parse(const uint8_t *buf, size_t len, int multi,
+                      const void *key, char *host, char *port)
+{
+	size_t off = multi ? 16 + IOSOCKS_UID_LEN : 16;
+	if (len < off + 1)
+	{
+		return 0;
+	}
+	const uint8_t *p = buf + off;
+
+	// 旧版请求头以域名开头，首字节不可能等于 IOSOCKS_VERSION
+	if (p[0] != IOSOCKS_VERSION)
+	{
+		if (multi)
+		{
+			return -1;
+		}
+		if (len < IOSOCKS_LEGACY_LEN)
+		{
+			return 0;
+		}
+		uint8_t digest[16];
+		md5(digest, p, 257 + 15);
+		if (memcmp(buf, digest, 16) != 0)
+		{
+			return -1;
+		}
+		memcpy(host, p, 256);
+		memcpy(port, p + 257, 14);
+		host[256] = '\0';
+		port[14] = '\0';
+		return IOSOCKS_LEGACY_LEN;
+	}
+
+	if (len < off + 3)
+	{
+		return 0;
+	}
+	size_t addr_len;
+	switch (p[1])
+	{
+	case ATYP_IPV4:
+		addr_len = 4;
+		break;
+	case ATYP_IPV6:
+		addr_len = 16;
+		break;
+	case ATYP_DOMAIN:
+		addr_len = 1 + p[2];
+		break;
+	default:
+		return -1;
+	}
+	size_t hdr_len = 2 + addr_len + 2;
+	if (len < off + hdr_len + IOSOCKS_MAC_LEN)
+	{
+		return 0;
+	}
+	uint8_t digest[16];
+	mac(digest, buf, key, p, hdr_len);
+	if (memcmp(p + hdr_len, digest, IOSOCKS_MAC_LEN) != 0)
+	{
+		return -1;
+	}
+
+	if (p[1] == ATYP_IPV4)
+	{
+		inet_ntop(AF_INET, p + 2, host, INET_ADDRSTRLEN);
+	}
+	else if (p[1] == ATYP_IPV6)
+	{
+		inet_ntop(AF_INET6, p + 2, host, INET6_ADDRSTRLEN);
+	}
+	else
+	{
+		memcpy(host, p + 3, p[2]);
+		host[p[2]] = '\0';
+	}
+	uint16_t port_n;
+	memcpy(&port_n, p + 2 + addr_len, 2);
+	sprintf(port, "%u", ntohs(port_n));
+	return off + hdr_len + IOSOCKS_MAC_LEN;
+}
@@ -0,0 +1,55 @@
+/*
+ * iosocks.h - IoSocks Protocol
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IOSOCKS_H
+#define IOSOCKS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "crypto.h"
+
+// IV 长度
+#define IOSOCKS_IV_LEN 16
+
+// 旧版（定长）请求头长度
+#define IOSOCKS_LEGACY_LEN (16 + 257 + 15)
+
+// 紧凑请求头的版本号
+#define IOSOCKS_VERSION 0x01
+
+// 多用户请求头中用户 ID 的长度
+#define IOSOCKS_UID_LEN 4
+
+// 紧凑请求头的 MAC 长度
+#define IOSOCKS_MAC_LEN 4
+
+// 请求头最大长度
+#define IOSOCKS_MAX_LEN IOSOCKS_LEGACY_LEN
+
+// 随请求头一起发送的客户端数据的最大长度
+#define IOSOCKS_EARLY_LEN 4096
+
+extern size_t iosocks_request(uint8_t *buf, const char *host, const char *port,
+                              int compact, uint32_t uid,
+                              const void *key, crypto_evp_t *evp);
+extern ssize_t iosocks_parse(const uint8_t *buf, size_t len, int multi,
+                             const void *key, char *host, char *port);
+
+#endif // IOSOCKS_H
@@ -23,20 +23,27 @@
 #include <string.h>
 #include <time.h>
 #include "log.h"
+#include "profile.h"
 
 void __log(FILE *stream, const char *format, ...)
 {
+	uint64_t begin = profile_now();
 	time_t now = time(NULL);
+	struct tm tm;
 	char timestr[20];
-	strftime(timestr, 20, "%y-%m-%d %H:%M:%S", localtime(&now));
+	strftime(timestr, 20, "%y-%m-%d %H:%M:%S", localtime_r(&now, &tm));
+	// 多个事件循环线程同时写日志时保持每行完整
+	flockfile(stream);
 	fprintf(stream, "[%s] ", timestr);
 
 	va_list args;
 	va_start(args, format);
 	vfprintf(stream, format, args);
 	va_end(args);
-	putchar('\n');
+	fputc('\n', stream);
 	fflush(stream);
+	funlockfile(stream);
+	profile_end(PROF_LOG, begin);
 }
 
 void __err(const char *msg)
@@ -20,6 +20,7 @@
 #include <stdint.h>
 #include <string.h>
 #include "md5.h"
+#include "profile.h"
 
 static inline uint32_t F(uint32_t x, uint32_t y, uint32_t z)
 {
@@ -58,7 +59,7 @@ static inline uint32_t LEFT_ROTATE(uint32_t x, uint32_t n)
 #define II(a, b, c, d, x, s, ac) \
 	do {(a) = (b) + LEFT_ROTATE((a) + I((b), (c), (d)) + (x) + (ac), s);} while (0)
 
-void md5(void *digest, const void *in, size_t len)
+static void md5_digest(void *digest, const void *in, size_t len)
 {
 	size_t n = len * 8 / 512 + 1;
 	uint32_t M[(n + 1) * 16];
@@ -171,3 +172,10 @@ void md5(void *digest, const void *in, size_t len)
 		memcpy(digest, state, sizeof(uint32_t) * 4);
 	}
 }
+
+void md5(void *digest, const void *in, size_t len)
+{
+	uint64_t begin = profile_now();
+	md5_digest(digest, in, len);
+	profile_end(PROF_MD5, begin);
+}
@@ -0,0 +1,67 @@
+/*
+ * mpsc.h - intrusive lock-free multi-producer single-consumer queue
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <stddef.h>
+
+// 节点嵌在元素的结构体中，通常作为第一个成员，取出后直接转换类型
+typedef struct mpsc_node
+{
+	struct mpsc_node *next;
+} mpsc_node_t;
+
+typedef struct
+{
+	mpsc_node_t *head;
+} mpsc_t;
+
+static inline void mpsc_init(mpsc_t *q)
+{
+	q->head = NULL;
+}
+
+// 任意线程都可以入队，无锁
+static inline void mpsc_push(mpsc_t *q, mpsc_node_t *node)
+{
+	mpsc_node_t *head = __atomic_load_n(&(q->head), __ATOMIC_RELAXED);
+	do
+	{
+		node->next = head;
+	} while (!__atomic_compare_exchange_n(&(q->head), &head, node, 1,
+	                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// 只能在消费者线程调用，一次取出所有节点，按入队的顺序返回
+static inline mpsc_node_t *mpsc_pop_all(mpsc_t *q)
+{
+	mpsc_node_t *node = __atomic_exchange_n(&(q->head), NULL, __ATOMIC_ACQUIRE);
+	mpsc_node_t *prev = NULL;
+	while (node != NULL)
+	{
+		mpsc_node_t *next = node->next;
+		node->next = prev;
+		prev = node;
+		node = next;
+	}
+	return prev;
+}
+
+#endif // MPSC_H
@@ -0,0 +1,146 @@
+/*
+ * pending.c - requests waiting for an available server
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ev.h>
+#include <stddef.h>
+#include "pending.h"
+
+#define UNUSED(x) do {(void)(x);} while (0)
+
+static void timeout_cb(EV_P_ ev_timer *w, int revents);
+
+extern __thread struct ev_loop *loop;
+
+static int max_num;
+static ev_tstamp wait_time;
+static int (*available_cb)(void);
+static void (*connect_cb)(pending_t *p);
+static void (*abort_cb)(pending_t *p);
+
+// 按期限排序，新请求的期限最晚，通常直接放在队尾
+static pending_t *head = NULL;
+static pending_t *tail = NULL;
+static int num = 0;
+static ev_timer w_timeout;
+
+void pending_init(int max, ev_tstamp timeout, int (*available)(void),
+                  void (*connect)(pending_t *p), void (*abort)(pending_t *p))
+{
+	max_num = max;
+	wait_time = timeout;
+	available_cb = available;
+	connect_cb = connect;
+	abort_cb = abort;
+	ev_init(&w_timeout, timeout_cb);
+}
+
+// 从队首开始期限最早，定时器对准队首
+static void rearm(void)
+{
+	ev_timer_stop(EV_A_ &w_timeout);
+	if (head != NULL)
+	{
+		ev_timer_set(&w_timeout, head->deadline - ev_now(EV_A), 0.0);
+		ev_timer_start(EV_A_ &w_timeout);
+	}
+}
+
+void pending_push(pending_t *p)
+{
+	if (num >= max_num)
+	{
+		abort_cb(p);
+		return;
+	}
+	if (p->deadline == 0.0)
+	{
+		p->deadline = ev_now(EV_A) + wait_time;
+	}
+	if ((tail == NULL) || (tail->deadline <= p->deadline))
+	{
+		p->next = NULL;
+		if (tail == NULL)
+		{
+			head = p;
+		}
+		else
+		{
+			tail->next = p;
+		}
+		tail = p;
+	}
+	else
+	{
+		// 重新排队的请求期限较早，插到期限更晚的请求之前
+		pending_t **pp = &head;
+		while ((*pp)->deadline <= p->deadline)
+		{
+			pp = &((*pp)->next);
+		}
+		p->next = *pp;
+		*pp = p;
+	}
+	num++;
+	if (head == p)
+	{
+		rearm();
+	}
+}
+
+static pending_t *pop(void)
+{
+	pending_t *p = head;
+	head = p->next;
+	if (head == NULL)
+	{
+		tail = NULL;
+	}
+	num--;
+	return p;
+}
+
+// 丢弃超时的请求
+static void timeout_cb(EV_P_ ev_timer *w, int revents)
+{
+	UNUSED(w);
+	UNUSED(revents);
+
+	ev_tstamp now = ev_now(EV_A);
+	while ((head != NULL) && (head->deadline <= now))
+	{
+		abort_cb(pop());
+	}
+	rearm();
+}
+
+void pending_dispatch(void)
+{
+	// connect 可能把请求重新放回队列，每个请求最多处理一次
+	int n = num;
+	while ((n-- > 0) && (head != NULL) && available_cb())
+	{
+		connect_cb(pop());
+	}
+	rearm();
+}
+
+int pending_empty(void)
+{
+	return head == NULL;
+}
@@ -0,0 +1,47 @@
+/*
+ * pending.h - requests waiting for an available server
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PENDING_H
+#define PENDING_H
+
+#include <ev.h>
+
+// 排队的请求，嵌入调用者的上下文中，第一次排队前 deadline 应当为 0
+typedef struct pending
+{
+	ev_tstamp deadline;
+	struct pending *next;
+} pending_t;
+
+// 最多 max 个请求排队，每个请求最多等待 timeout 秒，
+// available 返回非 0 表示有 server 可用，
+// connect 重新分派取出的请求，abort 在请求超时或者队列已满时放弃请求
+extern void pending_init(int max, ev_tstamp timeout, int (*available)(void),
+                         void (*connect)(pending_t *p), void (*abort)(pending_t *p));
+
+// 请求加入队列，重新排队的请求保留原来的期限，队列按期限排序
+extern void pending_push(pending_t *p);
+
+// 有 server 可用时按期限先后把排队的请求交给 connect
+extern void pending_dispatch(void);
+
+// 是否有请求在排队
+extern int pending_empty(void);
+
+#endif // PENDING_H
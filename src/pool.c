@@ -0,0 +1,288 @@
+/*
+ * pool.c - fixed-size object pool backed by huge pages
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "log.h"
+#include "pool.h"
+#include "profile.h"
+
+// 空闲对象组成单链表，链表指针保存在对象内部
+typedef struct object
+{
+	struct object *next;
+} object_t;
+
+// slab 的来源，归还时更新统计
+enum
+{
+	SLAB_SMALL,
+	SLAB_HUGETLB,
+	SLAB_THP
+};
+
+typedef struct
+{
+	uint8_t *base;
+	int kind;
+	size_t free;	// 仅在 pool_trim 中使用
+} slab_t;
+
+struct pool
+{
+	const char *name;
+	size_t size;
+	size_t in_use;
+	size_t capacity;
+	size_t slabs;
+	size_t hugetlb;
+	size_t thp;
+	object_t *free_list;
+	slab_t *slab_list;	// 按地址排序
+	size_t slab_cap;
+};
+
+// 优先使用 hugetlbfs 预留的大页，失败时分配 2 MB 对齐的普通内存，
+// 并建议内核使用透明大页
+static void *slab_alloc(int *kind)
+{
+	void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+	         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+	{
+		*kind = SLAB_HUGETLB;
+		return p;
+	}
+#endif
+
+	// 多映射一个 slab，再裁掉首尾，得到 2 MB 对齐的区域
+	uint8_t *raw = (uint8_t *)mmap(NULL, POOL_SLAB_SIZE * 2, PROT_READ | PROT_WRITE,
+	                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED)
+	{
+		return NULL;
+	}
+	uint8_t *aligned = (uint8_t *)(((uintptr_t)raw + POOL_SLAB_SIZE - 1)
+	                               & ~((uintptr_t)POOL_SLAB_SIZE - 1));
+	if (aligned > raw)
+	{
+		munmap(raw, aligned - raw);
+	}
+	munmap(aligned + POOL_SLAB_SIZE, raw + POOL_SLAB_SIZE - aligned);
+	*kind = SLAB_SMALL;
+#ifdef MADV_HUGEPAGE
+	if (madvise(aligned, POOL_SLAB_SIZE, MADV_HUGEPAGE) == 0)
+	{
+		*kind = SLAB_THP;
+	}
+#endif
+	return aligned;
+}
+
+// 记录新的 slab，保持按地址排序
+static int slab_add(pool_t *pool, uint8_t *base, int kind)
+{
+	if (pool->slabs == pool->slab_cap)
+	{
+		size_t cap = (pool->slab_cap == 0) ? 16 : pool->slab_cap * 2;
+		slab_t *list = (slab_t *)realloc(pool->slab_list, cap * sizeof(slab_t));
+		if (list == NULL)
+		{
+			return -1;
+		}
+		pool->slab_list = list;
+		pool->slab_cap = cap;
+	}
+	size_t i = pool->slabs;
+	while ((i > 0) && (pool->slab_list[i - 1].base > base))
+	{
+		pool->slab_list[i] = pool->slab_list[i - 1];
+		i--;
+	}
+	pool->slab_list[i].base = base;
+	pool->slab_list[i].kind = kind;
+	pool->slabs++;
+	pool->hugetlb += (kind == SLAB_HUGETLB);
+	pool->thp += (kind == SLAB_THP);
+	return 0;
+}
+
+// 对象所在的 slab，slab 按 POOL_SLAB_SIZE 对齐
+static slab_t *slab_find(pool_t *pool, const void *ptr)
+{
+	uint8_t *base = (uint8_t *)((uintptr_t)ptr & ~((uintptr_t)POOL_SLAB_SIZE - 1));
+	size_t lo = 0;
+	size_t hi = pool->slabs;
+	while (lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (pool->slab_list[mid].base < base)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return &pool->slab_list[lo];
+}
+
+pool_t *pool_new(const char *name, size_t size)
+{
+	pool_t *pool = (pool_t *)malloc(sizeof(pool_t));
+	if (pool == NULL)
+	{
+		return NULL;
+	}
+	// 对象按 64 字节（cache line）对齐
+	size = (size + 63) & ~(size_t)63;
+	if (size > POOL_SLAB_SIZE)
+	{
+		free(pool);
+		return NULL;
+	}
+	bzero(pool, sizeof(pool_t));
+	pool->name = name;
+	pool->size = size;
+	pool->free_list = NULL;
+	pool->slab_list = NULL;
+	return pool;
+}
+
+void *pool_alloc(pool_t *pool)
+{
+	if (pool->free_list == NULL)
+	{
+		// 切分一个新的 slab，对象在 slab 内连续存放
+		// 只统计这条慢路径，空闲链表上取一个对象比读一次 TSC 还快
+		uint64_t begin = profile_now();
+		int kind;
+		uint8_t *slab = (uint8_t *)slab_alloc(&kind);
+		if (slab == NULL)
+		{
+			profile_end(PROF_ALLOC, begin);
+			return NULL;
+		}
+		if (slab_add(pool, slab, kind) != 0)
+		{
+			munmap(slab, POOL_SLAB_SIZE);
+			profile_end(PROF_ALLOC, begin);
+			return NULL;
+		}
+		size_t n = POOL_SLAB_SIZE / pool->size;
+		for (size_t i = n; i > 0; i--)
+		{
+			object_t *obj = (object_t *)(slab + (i - 1) * pool->size);
+			obj->next = pool->free_list;
+			pool->free_list = obj;
+		}
+		pool->capacity += n;
+		profile_end(PROF_ALLOC, begin);
+	}
+	object_t *obj = pool->free_list;
+	pool->free_list = obj->next;
+	pool->in_use++;
+	return obj;
+}
+
+// 释放的对象留给之后的连接复用，slab 只由 pool_trim 归还给系统
+void pool_free(pool_t *pool, void *ptr)
+{
+	if (ptr != NULL)
+	{
+		object_t *obj = (object_t *)ptr;
+		obj->next = pool->free_list;
+		pool->free_list = obj;
+		pool->in_use--;
+	}
+}
+
+size_t pool_trim(pool_t *pool)
+{
+	if (pool->capacity == pool->in_use)
+	{
+		return 0;
+	}
+	// 统计每个 slab 中的空闲对象
+	for (size_t i = 0; i < pool->slabs; i++)
+	{
+		pool->slab_list[i].free = 0;
+	}
+	for (object_t *obj = pool->free_list; obj != NULL; obj = obj->next)
+	{
+		slab_find(pool, obj)->free++;
+	}
+	// 从空闲链表中摘掉全部空闲的 slab 中的对象
+	size_t n = POOL_SLAB_SIZE / pool->size;
+	object_t **pp = &pool->free_list;
+	while (*pp != NULL)
+	{
+		if (slab_find(pool, *pp)->free == n)
+		{
+			*pp = (*pp)->next;
+		}
+		else
+		{
+			pp = &((*pp)->next);
+		}
+	}
+	// 归还这些 slab，其余的保持顺序
+	size_t released = 0;
+	size_t j = 0;
+	for (size_t i = 0; i < pool->slabs; i++)
+	{
+		slab_t *slab = &pool->slab_list[i];
+		if (slab->free == n)
+		{
+			munmap(slab->base, POOL_SLAB_SIZE);
+			pool->hugetlb -= (slab->kind == SLAB_HUGETLB);
+			pool->thp -= (slab->kind == SLAB_THP);
+			pool->capacity -= n;
+			released++;
+		}
+		else
+		{
+			pool->slab_list[j++] = *slab;
+		}
+	}
+	pool->slabs = j;
+	return released;
+}
+
+void pool_stats(const pool_t *pool, pool_stats_t *stats)
+{
+	stats->size = pool->size;
+	stats->in_use = pool->in_use;
+	stats->capacity = pool->capacity;
+	stats->slabs = pool->slabs;
+	stats->hugetlb = pool->hugetlb;
+	stats->thp = pool->thp;
+}
+
+void pool_log(const pool_t *pool)
+{
+	LOG("pool %s: %zu/%zu objects of %zu bytes, %zu slabs (%zu hugetlb, %zu thp advised, %zu small pages)",
+	    pool->name, pool->in_use, pool->capacity, pool->size, pool->slabs,
+	    pool->hugetlb, pool->thp, pool->slabs - pool->hugetlb - pool->thp);
+}
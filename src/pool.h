@@ -0,0 +1,50 @@
+/*
+ * pool.h - fixed-size object pool backed by huge pages
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// slab 大小，与 x86-64 的大页相同
+#define POOL_SLAB_SIZE (2 * 1024 * 1024)
+
+typedef struct pool pool_t;
+
+typedef struct
+{
+	size_t size;
+	size_t in_use;
+	size_t capacity;
+	size_t slabs;
+	size_t hugetlb;
+	size_t thp;
+} pool_stats_t;
+
+extern pool_t *pool_new(const char *name, size_t size);
+extern void *pool_alloc(pool_t *pool);
+extern void pool_free(pool_t *pool, void *ptr);
+
+// 把全部空闲的 slab 归还给系统，返回归还的 slab 数
+// 需要遍历空闲链表，只应在定时器中调用
+extern size_t pool_trim(pool_t *pool);
+extern void pool_stats(const pool_t *pool, pool_stats_t *stats);
+extern void pool_log(const pool_t *pool);
+
+#endif // POOL_H
@@ -0,0 +1,53 @@
+/*
+ * probes.h - USDT probes
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+// 静态探针，provider 为 iosocks，可以用 bpftrace 等工具挂载：
+//   accept(fd[, server_id])                     接受连接，ioserver 带 server_id
+//   handshake(fd, server_id, ok)                ioserver 验证请求头，ok 为 0 表示拒绝
+//   resolve_start(fd, host)                     ioserver 开始解析域名
+//   resolve_end(fd, ok)                         ioserver 域名解析结束
+//   connect_start(fd, server_id[, family])      开始连接，ioserver 带目标地址族
+//   connect_end(fd, server_id, ok[, family])    连接结束，ioserver 带目标地址族
+//   relay_read(fd, bytes)                       relay 从 fd 读到数据
+//   relay_write(fd, bytes)                      relay 向 fd 写入数据
+//   relay_eagain(fd)                            relay 读写 fd 时遇到 EAGAIN
+//   relay_close(local, remote, tx, rx)          relay 结束，tx、rx 为两个方向的总字节数
+// 未挂载时探针只是一条 nop 指令
+
+#ifdef HAVE_SYS_SDT_H
+#  include <sys/sdt.h>
+#  define PROBE1(name, a) DTRACE_PROBE1(iosocks, name, a)
+#  define PROBE2(name, a, b) DTRACE_PROBE2(iosocks, name, a, b)
+#  define PROBE3(name, a, b, c) DTRACE_PROBE3(iosocks, name, a, b, c)
+#  define PROBE4(name, a, b, c, d) DTRACE_PROBE4(iosocks, name, a, b, c, d)
+#else
+#  define PROBE1(name, a) do {(void)(a);} while (0)
+#  define PROBE2(name, a, b) do {(void)(a); (void)(b);} while (0)
+#  define PROBE3(name, a, b, c) do {(void)(a); (void)(b); (void)(c);} while (0)
+#  define PROBE4(name, a, b, c, d) do {(void)(a); (void)(b); (void)(c); (void)(d);} while (0)
+#endif
+
+#endif // PROBES_H
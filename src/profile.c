@@ -0,0 +1,118 @@
+/*
+ * profile.c - per-phase CPU time attribution
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ev.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "log.h"
+#include "profile.h"
+
+#define UNUSED(x) do {(void)(x);} while (0)
+
+static void release_cb(EV_P);
+static void acquire_cb(EV_P);
+static void stats_cb(EV_P_ ev_signal *w, int revents);
+
+extern __thread struct ev_loop *loop;
+
+__thread profile_t profile_local;
+
+static const char *names[PROF_MAX] = {"poll", "crypto", "md5", "syscall", "log", "alloc"};
+
+// 已注册的线程，线程不会退出，链表中的指针一直有效
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static profile_t *threads = NULL;
+static profile_t **tail = &threads;
+static __thread uint64_t poll_begin;
+static ev_signal w_stats;
+
+void profile_init(void)
+{
+	profile_loop();
+	ev_signal_init(&w_stats, stats_cb, SIGUSR1);
+	ev_signal_start(EV_A_ &w_stats);
+}
+
+void profile_loop(void)
+{
+	profile_thread("loop");
+	ev_set_loop_release_cb(EV_A_ release_cb, acquire_cb);
+}
+
+void profile_thread(const char *name)
+{
+	profile_t *p = &profile_local;
+	bzero(p, sizeof(profile_t));
+	p->name = name;
+	p->start = profile_now();
+	pthread_mutex_lock(&lock);
+	for (profile_t *q = threads; q != NULL; q = q->next)
+	{
+		if (strcmp(q->name, name) == 0)
+		{
+			p->id++;
+		}
+	}
+	*tail = p;
+	tail = &(p->next);
+	pthread_mutex_unlock(&lock);
+}
+
+// libev 在进入和离开 epoll_wait 时调用
+static void release_cb(EV_P)
+{
+	UNUSED(loop);
+	poll_begin = profile_now();
+}
+
+static void acquire_cb(EV_P)
+{
+	UNUSED(loop);
+	profile_end(PROF_POLL, poll_begin);
+}
+
+static void stats_cb(EV_P_ ev_signal *w, int revents)
+{
+	UNUSED(loop);
+	UNUSED(w);
+	UNUSED(revents);
+
+	pthread_mutex_lock(&lock);
+	for (profile_t *p = threads; p != NULL; p = p->next)
+	{
+		uint64_t total = profile_now() - p->start;
+		uint64_t other = total;
+		char buf[512];
+		int len = 0;
+		for (int i = 0; i < PROF_MAX; i++)
+		{
+			uint64_t cycles = __atomic_load_n(&(p->cycles[i]), __ATOMIC_RELAXED);
+			uint64_t calls = __atomic_load_n(&(p->calls[i]), __ATOMIC_RELAXED);
+			other -= (cycles < other) ? cycles : other;
+			len += snprintf(buf + len, sizeof(buf) - len, "%s %.1f%% (%lu calls), ",
+			                names[i], total ? 100.0 * cycles / total : 0.0, (unsigned long)calls);
+		}
+		snprintf(buf + len, sizeof(buf) - len, "other %.1f%%", total ? 100.0 * other / total : 0.0);
+		LOG("profile %s %d: %s", p->name, p->id, buf);
+	}
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,83 @@
+/*
+ * profile.h - per-phase CPU time attribution
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#else
+#  include <time.h>
+#endif
+
+// 常开的轻量 profile：用 TSC 周期计数累计每个线程在各阶段花费的时间，
+// 收到 SIGUSR1 时输出各阶段所占的比例，剩余部分计为 other (回调中的其他逻辑)
+enum
+{
+	PROF_POLL,      // 事件循环阻塞在 epoll_wait
+	PROF_CRYPTO,    // RC4
+	PROF_MD5,
+	PROF_SYSCALL,   // relay 中的 send/recv/epoll_wait
+	PROF_LOG,
+	PROF_ALLOC,     // 内存池切分新的 slab
+	PROF_MAX
+};
+
+typedef struct profile
+{
+	uint64_t cycles[PROF_MAX];
+	uint64_t calls[PROF_MAX];
+	uint64_t start;
+	const char *name;
+	int id;
+	struct profile *next;
+} profile_t;
+
+extern __thread profile_t profile_local;
+
+static inline uint64_t profile_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// 只有本线程写入，输出统计的线程不加锁读取，用 relaxed 原子写保证读到的值完整
+static inline void profile_end(int phase, uint64_t begin)
+{
+	profile_t *p = &profile_local;
+	__atomic_store_n(&(p->cycles[phase]), p->cycles[phase] + (profile_now() - begin), __ATOMIC_RELAXED);
+	__atomic_store_n(&(p->calls[phase]), p->calls[phase] + 1, __ATOMIC_RELAXED);
+}
+
+// 在主事件循环线程中调用，统计 poll 时间并注册 SIGUSR1
+extern void profile_init(void);
+
+// 其他事件循环在自己的线程中调用
+extern void profile_loop(void);
+
+// 需要输出统计的线程启动时调用一次
+extern void profile_thread(const char *name);
+
+#endif // PROFILE_H
@@ -20,18 +20,51 @@
 #include <assert.h>
 #include <errno.h>
 #include <ev.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include "crypto.h"
 #include "log.h"
+#include "pool.h"
+#include "probes.h"
+#include "profile.h"
 #include "relay.h"
+#include "trace.h"
+#include "worker.h"
 
 #define UNUSED(x) do {(void)(x);} while (0)
 
-// 缓冲区大小
-#define BUF_SIZE 8192
+// 缓冲区按 2 的幂分级，最小 4 KB，新连接从 8 KB 开始
+#define MIN_BUF 4096
+#define INIT_CLASS 1
+#define MAX_CLASS 7
+#define CLASS_SIZE(c) ((size_t)MIN_BUF << (c))
+
+// 连续这么多次读满缓冲区后扩大一级
+#define GROW_STREAK 2
+
+// 空闲超过这么多秒的方向换回最小的缓冲区，每隔同样的时间检查一次
+#define SHRINK_IDLE 5.0
+
+// 半关闭状态下，连接空闲超过该时间后释放
+#define LINGER_TIMEOUT 60.0
+
+// 边沿触发模式下，每个连接每个方向每轮最多转发的字节数
+#define BUDGET (64 * 1024)
+
+// 每次 epoll_wait 最多取回的事件数
+#define MAX_EVENTS 64
+
+// corked 中的标志位，表示该 socket 设置了 TCP_CORK，需要在本轮迭代结束时解除
+#define CORK_LOCAL  0x01
+#define CORK_REMOTE 0x02
 
 #ifndef EAGAIN
 #  define EAGAIN EWOULDBLOCK
@@ -40,45 +73,300 @@
 #  define EWOULDBLOCK EAGAIN
 #endif
 
+typedef struct ctx ctx_t;
+
+// 一个方向的缓冲区，大小随吞吐量调整
 typedef struct
+{
+	uint8_t *data;
+	int cls;
+	unsigned streak;
+	ev_tstamp active;
+} buf_t;
+
+// 边沿触发模式下每个 socket 的就绪状态，由用户态维护
+typedef struct
+{
+	ctx_t *ctx;
+	int fd;
+	uint32_t ready;
+} endpoint_t;
+
+struct ctx
 {
 	int sock_local;
 	int sock_remote;
+	int tag;
+	relay_sample_t sample;
 	ssize_t rx_bytes;
 	ssize_t rx_offset;
 	ssize_t tx_bytes;
 	ssize_t tx_offset;
+	int local_eof;
+	int remote_eof;
+	uint64_t tx_total;
+	uint64_t rx_total;
+	int corked;
+	ctx_t *cork_next;
+	trace_t *trace;
 	crypto_evp_t evp;
+	ev_timer w_linger;
 	ev_io w_local_read;
 	ev_io w_local_write;
 	ev_io w_remote_read;
 	ev_io w_remote_write;
-	uint8_t rx_buf[BUF_SIZE];
-	uint8_t tx_buf[BUF_SIZE];
-} ctx_t;
+	buf_t rx_buf;
+	buf_t tx_buf;
+	endpoint_t ep_local;
+	endpoint_t ep_remote;
+	job_t tx_job;
+	job_t rx_job;
+	int queued;
+	int dead;
+	ctx_t *next;
+	ctx_t *all_prev;
+	ctx_t *all_next;
+};
 
 static void local_read_cb(EV_P_ ev_io *w, int revents);
 static void local_write_cb(EV_P_ ev_io *w, int revents);
 static void remote_read_cb(EV_P_ ev_io *w, int revents);
 static void remote_write_cb(EV_P_ ev_io *w, int revents);
+static void linger_cb(EV_P_ ev_timer *w, int revents);
+static void half_close(EV_P_ ctx_t *ctx);
 static void cleanup(EV_P_ ctx_t *ctx);
+static void relay_edge(EV_P_ ctx_t *ctx);
+static void epoll_cb(EV_P_ ev_io *w, int revents);
+static void idle_cb(EV_P_ ev_idle *w, int revents);
+static void run_queue(EV_P);
+static void enqueue(ctx_t *ctx);
+static void pump(EV_P_ ctx_t *ctx);
+static void stats_cb(EV_P_ ev_signal *w, int revents);
+static void report_cb(EV_P_ ev_async *w, int revents);
+static void crypt_done(EV_P_ job_t *job);
+static int busy(const ctx_t *ctx);
+static ssize_t fill(int fd, buf_t *buf, ssize_t limit, int drain, int *full, int *eagain);
+static void grow(buf_t *buf, ssize_t n);
+static int buf_alloc(buf_t *buf, int cls);
+static void release(ctx_t *ctx);
+static void shrink_cb(EV_P_ ev_timer *w, int revents);
+static void cork(endpoint_t *ep);
+static void flush_cb(EV_P_ ev_prepare *w, int revents);
+
+extern __thread struct ev_loop *loop;
+
+// 以下状态每个事件循环一份，由 relay_init 或 relay_loop_init 在循环所在的线程中初始化
+
+// 边沿触发模式使用独立的 epoll，epfd 为 -1 时使用 libev 的 ev_io
+static int edge_mode = 0;
+static __thread int epfd = -1;
+static __thread ev_io w_epoll;
+static __thread ev_idle w_idle;
+
+// 转发额度用完、仍有数据可读写的连接
+static __thread ctx_t *run_head = NULL;
+static __thread ctx_t **run_tail = NULL;
+
+// 所有活动的连接，供 relay_foreach 遍历
+static __thread ctx_t *all_head = NULL;
+
+// 连接上下文集中分配在大页上，减少 TLB miss
+static __thread pool_t *ctx_pool = NULL;
+static ev_signal w_stats;
+
+// 每一级缓冲区一个 pool，max_class 对应配置的上限
+static __thread pool_t *buf_pool[MAX_CLASS + 1];
+static const char *buf_name[MAX_CLASS + 1] = {
+	"buffer 4k", "buffer 8k", "buffer 16k", "buffer 32k",
+	"buffer 64k", "buffer 128k", "buffer 256k", "buffer 512k"
+};
+static int max_class = MAX_CLASS;
+static __thread ev_timer w_shrink;
+
+// 加解密交给 worker 线程
+static int offload = 0;
+
+// 合并小块数据，设置了 TCP_CORK 的连接在本轮迭代结束时推送
+static int coalesce = 0;
+static __thread ctx_t *cork_head = NULL;
+static __thread ev_prepare w_flush;
 
-extern struct ev_loop *loop;
+// 本循环的负载，供其他线程读取
+static __thread relay_load_t load;
 
-void relay(int local, int remote, crypto_evp_t *evp)
+// 收到 SIGUSR1 时通知每个事件循环在自己的线程中输出统计
+typedef struct reporter
 {
-	ctx_t *ctx = (ctx_t *)malloc(sizeof(ctx_t));
-	if (ctx == NULL)
+	struct ev_loop *loop;
+	ev_async w_report;
+	int id;
+	struct reporter *next;
+} reporter_t;
+
+static pthread_mutex_t reporter_lock = PTHREAD_MUTEX_INITIALIZER;
+static reporter_t *reporters = NULL;
+static int reporter_num = 0;
+static __thread reporter_t reporter;
+
+int relay_init(int edge, int threads, int merge, int buffer_max)
+{
+	coalesce = merge;
+	// 只有边沿触发模式才会在一轮迭代中多次读写同一个 socket，合并只在该模式下有意义
+	edge_mode = edge || merge;
+	if (threads > 0)
+	{
+		// worker 线程只在边沿触发模式下使用
+		if (worker_init(threads) != 0)
+		{
+			return -1;
+		}
+		offload = 1;
+		edge_mode = 1;
+	}
+	// 边沿触发模式下一次读取不超过每轮的额度，更大的缓冲区用不满
+	if (edge_mode && (buffer_max > BUDGET))
+	{
+		buffer_max = BUDGET;
+	}
+	max_class = 0;
+	while ((max_class < MAX_CLASS) && (CLASS_SIZE(max_class + 1) <= (size_t)buffer_max))
+	{
+		max_class++;
+	}
+	ev_signal_init(&w_stats, stats_cb, SIGUSR1);
+	ev_signal_start(EV_A_ &w_stats);
+	return relay_loop_init();
+}
+
+int relay_loop_init(void)
+{
+	run_tail = &run_head;
+	ctx_pool = pool_new("relay", sizeof(ctx_t));
+	if (ctx_pool == NULL)
+	{
+		LOG("out of memory");
+		return -1;
+	}
+	for (int i = 0; i <= MAX_CLASS; i++)
+	{
+		buf_pool[i] = pool_new(buf_name[i], CLASS_SIZE(i));
+		if (buf_pool[i] == NULL)
+		{
+			LOG("out of memory");
+			return -1;
+		}
+	}
+	ev_timer_init(&w_shrink, shrink_cb, SHRINK_IDLE, SHRINK_IDLE);
+	ev_timer_start(EV_A_ &w_shrink);
+	if (coalesce)
+	{
+		// ev_check 在下一轮 epoll_wait 返回之后才执行，会把数据多延迟一次等待，
+		// 所以在进入等待之前的 ev_prepare 中推送
+		ev_prepare_init(&w_flush, flush_cb);
+		ev_set_priority(&w_flush, EV_MINPRI);
+		ev_prepare_start(EV_A_ &w_flush);
+	}
+	reporter.loop = loop;
+	ev_async_init(&reporter.w_report, report_cb);
+	ev_async_start(EV_A_ &reporter.w_report);
+	pthread_mutex_lock(&reporter_lock);
+	reporter.id = reporter_num++;
+	reporter.next = reporters;
+	reporters = &reporter;
+	pthread_mutex_unlock(&reporter_lock);
+	if (!edge_mode)
+	{
+		return 0;
+	}
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+	{
+		ERROR("epoll_create1");
+		return -1;
+	}
+	ev_io_init(&w_epoll, epoll_cb, epfd, EV_READ);
+	ev_idle_init(&w_idle, idle_cb);
+	ev_io_start(EV_A_ &w_epoll);
+	return 0;
+}
+
+relay_load_t *relay_load(void)
+{
+	return &load;
+}
+
+void relay(int local, int remote, int tag, crypto_evp_t *evp,
+           const void *buf, size_t len, trace_t *trace)
+{
+	ctx_t *ctx = (ctx_t *)pool_alloc(ctx_pool);
+	int cls = (INIT_CLASS < max_class) ? INIT_CLASS : max_class;
+	// 先发往 local 的数据必须放得下，buffer_max 很小时第一个缓冲区可以超过上限
+	int rx_cls = cls;
+	while ((rx_cls < MAX_CLASS) && (CLASS_SIZE(rx_cls) < len))
+	{
+		rx_cls++;
+	}
+	if (ctx != NULL)
+	{
+		ctx->tx_buf.data = NULL;
+		ctx->rx_buf.data = NULL;
+		__atomic_store_n(&(load.active), load.active + 1, __ATOMIC_RELAXED);
+	}
+	if ((ctx == NULL) || (buf_alloc(&(ctx->tx_buf), cls) != 0)
+	    || (buf_alloc(&(ctx->rx_buf), rx_cls) != 0))
 	{
 		LOG("out of memory");
 		close(local);
 		close(remote);
+		trace_close(trace);
+		if (ctx != NULL)
+		{
+			release(ctx);
+		}
 		return;
 	}
 	ctx->sock_local = local;
 	ctx->sock_remote = remote;
+	ctx->tag = tag;
+	ctx->sample.retrans = 0;
+	ctx->sample.segs = 0;
+	ctx->all_prev = NULL;
+	ctx->all_next = all_head;
+	if (all_head != NULL)
+	{
+		all_head->all_prev = ctx;
+	}
+	all_head = ctx;
 	ctx->evp = *evp;
+	ctx->local_eof = 0;
+	ctx->remote_eof = 0;
+	ctx->rx_bytes = 0;
+	ctx->tx_bytes = 0;
+	ctx->tx_total = 0;
+	ctx->rx_total = 0;
+	ctx->trace = trace;
+	ctx->corked = 0;
+	ctx->queued = 0;
+	ctx->dead = 0;
+	ctx->tx_job.pending = 0;
+	ctx->rx_job.pending = 0;
+	if (len > 0)
+	{
+		// 先把已收到的数据发往 local
+		assert(len <= CLASS_SIZE(ctx->rx_buf.cls));
+		memcpy(ctx->rx_buf.data, buf, len);
+		ctx->rx_bytes = (ssize_t)len;
+		ctx->rx_offset = 0;
+		ctx->rx_total = (uint64_t)len;
+	}
 
+	ev_timer_init(&(ctx->w_linger), linger_cb, 0, LINGER_TIMEOUT);
+	ctx->w_linger.data = (void *)ctx;
+	if (epfd >= 0)
+	{
+		relay_edge(EV_A_ ctx);
+		return;
+	}
 	ev_io_init(&(ctx->w_local_read), local_read_cb, ctx->sock_local, EV_READ);
 	ev_io_init(&(ctx->w_local_write), local_write_cb, ctx->sock_local, EV_WRITE);
 	ev_io_init(&(ctx->w_remote_read), remote_read_cb, ctx->sock_remote, EV_READ);
@@ -88,7 +376,14 @@ void relay(int local, int remote, crypto_evp_t *evp)
 	ctx->w_remote_read.data = (void *)ctx;
 	ctx->w_remote_write.data = (void *)ctx;
 	ev_io_start(EV_A_ &(ctx->w_local_read));
-	ev_io_start(EV_A_ &(ctx->w_remote_read));
+	if (len > 0)
+	{
+		ev_io_start(EV_A_ &(ctx->w_local_write));
+	}
+	else
+	{
+		ev_io_start(EV_A_ &(ctx->w_remote_read));
+	}
 }
 
 static void local_read_cb(EV_P_ ev_io *w, int revents)
@@ -98,23 +393,43 @@ static void local_read_cb(EV_P_ ev_io *w, int revents)
 	UNUSED(revents);
 	assert(ctx != NULL);
 
-	ctx->tx_bytes = recv(ctx->sock_local, ctx->tx_buf, BUF_SIZE, 0);
+	int full, eagain;
+	ctx->tx_bytes = fill(ctx->sock_local, &(ctx->tx_buf), 0, 0, &full, &eagain);
 	if (ctx->tx_bytes <= 0)
 	{
 		if (ctx->tx_bytes < 0)
 		{
 			LOG("client reset");
+			cleanup(EV_A_ ctx);
+			return;
 		}
-		cleanup(EV_A_ ctx);
+		// local 关闭了写端，把 FIN 转发给 remote，另一个方向继续转发
+		ctx->local_eof = 1;
+		ev_io_stop(EV_A_ w);
+		shutdown(ctx->sock_remote, SHUT_WR);
+		half_close(EV_A_ ctx);
 		return;
 	}
-	crypto_encrypt(ctx->tx_buf, ctx->tx_bytes, &(ctx->evp));
-	ssize_t n = send(ctx->sock_remote, ctx->tx_buf,
+	if (ctx->remote_eof)
+	{
+		ev_timer_again(EV_A_ &(ctx->w_linger));
+	}
+	if (ctx->tx_total == 0)
+	{
+		trace_point(ctx->trace, "first tx byte");
+	}
+	ctx->tx_total += ctx->tx_bytes;
+	crypto_encrypt(ctx->tx_buf.data, ctx->tx_bytes, &(ctx->evp));
+	uint64_t begin = profile_now();
+	ssize_t n = send(ctx->sock_remote, ctx->tx_buf.data,
 	                 ctx->tx_bytes, MSG_NOSIGNAL);
+	profile_end(PROF_SYSCALL, begin);
+	PROBE2(relay_write, ctx->sock_remote, n);
 	if (n < 0)
 	{
 		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
 		{
+			PROBE1(relay_eagain, ctx->sock_remote);
 			ctx->tx_offset = 0;
 		}
 		else
@@ -131,6 +446,7 @@ static void local_read_cb(EV_P_ ev_io *w, int revents)
 	}
 	else
 	{
+		ctx->tx_bytes = 0;
 		return;
 	}
 	ev_io_start(EV_A_ &(ctx->w_remote_write));
@@ -145,12 +461,16 @@ static void local_write_cb(EV_P_ ev_io *w, int revents)
 	assert(ctx != NULL);
 	assert(ctx->rx_bytes > 0);
 
-	ssize_t n = send(ctx->sock_local, ctx->rx_buf + ctx->rx_offset,
+	uint64_t begin = profile_now();
+	ssize_t n = send(ctx->sock_local, ctx->rx_buf.data + ctx->rx_offset,
 	                 ctx->rx_bytes, MSG_NOSIGNAL);
+	profile_end(PROF_SYSCALL, begin);
+	PROBE2(relay_write, ctx->sock_local, n);
 	if (n < 0)
 	{
 		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
 		{
+			PROBE1(relay_eagain, ctx->sock_local);
 			return;
 		}
 		else
@@ -167,6 +487,7 @@ static void local_write_cb(EV_P_ ev_io *w, int revents)
 	}
 	else
 	{
+		ctx->rx_bytes = 0;
 		ev_io_start(EV_A_ &(ctx->w_remote_read));
 		ev_io_stop(EV_A_ w);
 	}
@@ -179,23 +500,43 @@ static void remote_read_cb(EV_P_ ev_io *w, int revents)
 	UNUSED(revents);
 	assert(ctx != NULL);
 
-	ctx->rx_bytes = recv(ctx->sock_remote, ctx->rx_buf, BUF_SIZE, 0);
+	int full, eagain;
+	ctx->rx_bytes = fill(ctx->sock_remote, &(ctx->rx_buf), 0, 0, &full, &eagain);
 	if (ctx->rx_bytes <= 0)
 	{
 		if (ctx->rx_bytes < 0)
 		{
 			LOG("server reset");
+			cleanup(EV_A_ ctx);
+			return;
 		}
-		cleanup(EV_A_ ctx);
+		// remote 关闭了写端，把 FIN 转发给 local，另一个方向继续转发
+		ctx->remote_eof = 1;
+		ev_io_stop(EV_A_ w);
+		shutdown(ctx->sock_local, SHUT_WR);
+		half_close(EV_A_ ctx);
 		return;
 	}
-	crypto_decrypt(ctx->rx_buf, ctx->rx_bytes, &(ctx->evp));
-	ssize_t n = send(ctx->sock_local, ctx->rx_buf,
+	if (ctx->local_eof)
+	{
+		ev_timer_again(EV_A_ &(ctx->w_linger));
+	}
+	if (ctx->rx_total == 0)
+	{
+		trace_point(ctx->trace, "first rx byte");
+	}
+	ctx->rx_total += ctx->rx_bytes;
+	crypto_decrypt(ctx->rx_buf.data, ctx->rx_bytes, &(ctx->evp));
+	uint64_t begin = profile_now();
+	ssize_t n = send(ctx->sock_local, ctx->rx_buf.data,
 	                 ctx->rx_bytes, MSG_NOSIGNAL);
+	profile_end(PROF_SYSCALL, begin);
+	PROBE2(relay_write, ctx->sock_local, n);
 	if (n < 0)
 	{
 		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
 		{
+			PROBE1(relay_eagain, ctx->sock_local);
 			ctx->rx_offset = 0;
 		}
 		else
@@ -212,6 +553,7 @@ static void remote_read_cb(EV_P_ ev_io *w, int revents)
 	}
 	else
 	{
+		ctx->rx_bytes = 0;
 		return;
 	}
 	ev_io_start(EV_A_ &(ctx->w_local_write));
@@ -226,14 +568,16 @@ static void remote_write_cb(EV_P_ ev_io *w, int revents)
 	assert(ctx != NULL);
 	assert(ctx->tx_bytes > 0);
 
-	ev_io_stop(EV_A_ w);
-
-	ssize_t n = send(ctx->sock_remote, ctx->tx_buf + ctx->tx_offset,
+	uint64_t begin = profile_now();
+	ssize_t n = send(ctx->sock_remote, ctx->tx_buf.data + ctx->tx_offset,
 	                 ctx->tx_bytes, MSG_NOSIGNAL);
+	profile_end(PROF_SYSCALL, begin);
+	PROBE2(relay_write, ctx->sock_remote, n);
 	if (n < 0)
 	{
 		if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
 		{
+			PROBE1(relay_eagain, ctx->sock_remote);
 			return;
 		}
 		else
@@ -250,18 +594,601 @@ static void remote_write_cb(EV_P_ ev_io *w, int revents)
 	}
 	else
 	{
+		ctx->tx_bytes = 0;
 		ev_io_start(EV_A_ &(ctx->w_local_read));
 		ev_io_stop(EV_A_ w);
 	}
 }
 
+void relay_foreach(void (*cb)(int tag, int sock, relay_sample_t *last, void *data),
+                   void *data)
+{
+	for (ctx_t *ctx = all_head; ctx != NULL; ctx = ctx->all_next)
+	{
+		cb(ctx->tag, ctx->sock_remote, &(ctx->sample), data);
+	}
+}
+
+static void stats_cb(EV_P_ ev_signal *w, int revents)
+{
+	UNUSED(loop);
+	UNUSED(w);
+	UNUSED(revents);
+
+	pthread_mutex_lock(&reporter_lock);
+	for (reporter_t *r = reporters; r != NULL; r = r->next)
+	{
+		ev_async_send(r->loop, &(r->w_report));
+	}
+	pthread_mutex_unlock(&reporter_lock);
+}
+
+static void report_cb(EV_P_ ev_async *w, int revents)
+{
+	UNUSED(loop);
+	UNUSED(w);
+	UNUSED(revents);
+
+	pool_log(ctx_pool);
+	size_t total = 0;
+	for (int i = 0; i <= MAX_CLASS; i++)
+	{
+		pool_stats_t stats;
+		pool_stats(buf_pool[i], &stats);
+		if (stats.capacity > 0)
+		{
+			pool_log(buf_pool[i]);
+		}
+		total += stats.in_use * stats.size;
+	}
+	if (reporter_num > 1)
+	{
+		LOG("relay buffers: %zu KB in use on loop %d", total / 1024, reporter.id);
+	}
+	else
+	{
+		LOG("relay buffers: %zu KB in use", total / 1024);
+	}
+}
+
+// 空闲的方向换回最小的缓冲区，有数据未发送或者 worker 线程正在使用时跳过
+static void shrink_cb(EV_P_ ev_timer *w, int revents)
+{
+	UNUSED(w);
+	UNUSED(revents);
+
+	ev_tstamp now = ev_now(EV_A);
+	for (ctx_t *ctx = all_head; ctx != NULL; ctx = ctx->all_next)
+	{
+		if ((ctx->tx_buf.cls > 0) && (ctx->tx_bytes == 0) && !ctx->tx_job.pending
+		    && (now - ctx->tx_buf.active > SHRINK_IDLE))
+		{
+			buf_alloc(&(ctx->tx_buf), 0);
+		}
+		if ((ctx->rx_buf.cls > 0) && (ctx->rx_bytes == 0) && !ctx->rx_job.pending
+		    && (now - ctx->rx_buf.active > SHRINK_IDLE))
+		{
+			buf_alloc(&(ctx->rx_buf), 0);
+		}
+	}
+	// 大缓冲区的 slab 全部空闲后归还给系统，突发的大流量结束后 RSS 随之下降
+	for (int i = INIT_CLASS + 1; i <= MAX_CLASS; i++)
+	{
+		pool_trim(buf_pool[i]);
+	}
+}
+
+// 把缓冲区换成 cls 级，原有内容不保留，失败时保持不变
+static int buf_alloc(buf_t *buf, int cls)
+{
+	uint8_t *data = (uint8_t *)pool_alloc(buf_pool[cls]);
+	if (data == NULL)
+	{
+		return -1;
+	}
+	if (buf->data != NULL)
+	{
+		pool_free(buf_pool[buf->cls], buf->data);
+	}
+	buf->data = data;
+	buf->cls = cls;
+	buf->streak = 0;
+	buf->active = ev_now(loop);
+	return 0;
+}
+
+// 连续 GROW_STREAK 次读满缓冲区时扩大一级，已读到的 n 字节复制到新缓冲区
+static void grow(buf_t *buf, ssize_t n)
+{
+	buf->active = ev_now(loop);
+	if ((size_t)n < CLASS_SIZE(buf->cls))
+	{
+		buf->streak = 0;
+		return;
+	}
+	if ((++buf->streak < GROW_STREAK) || (buf->cls >= max_class))
+	{
+		return;
+	}
+	uint8_t *data = (uint8_t *)pool_alloc(buf_pool[buf->cls + 1]);
+	if (data == NULL)
+	{
+		return;
+	}
+	memcpy(data, buf->data, n);
+	pool_free(buf_pool[buf->cls], buf->data);
+	buf->data = data;
+	buf->cls++;
+	buf->streak = 0;
+}
+
+static void release(ctx_t *ctx)
+{
+	if (ctx->tx_buf.data != NULL)
+	{
+		pool_free(buf_pool[ctx->tx_buf.cls], ctx->tx_buf.data);
+	}
+	if (ctx->rx_buf.data != NULL)
+	{
+		pool_free(buf_pool[ctx->rx_buf.cls], ctx->rx_buf.data);
+	}
+	pool_free(ctx_pool, ctx);
+	__atomic_store_n(&(load.active), load.active - 1, __ATOMIC_RELAXED);
+}
+
+static void linger_cb(EV_P_ ev_timer *w, int revents)
+{
+	ctx_t *ctx = (ctx_t *)(w->data);
+
+	UNUSED(revents);
+	assert(ctx != NULL);
+
+	cleanup(EV_A_ ctx);
+}
+
+// 两个方向都结束后释放连接，否则等待另一个方向结束或者空闲超时
+static void half_close(EV_P_ ctx_t *ctx)
+{
+	if (ctx->local_eof && ctx->remote_eof)
+	{
+		cleanup(EV_A_ ctx);
+	}
+	else
+	{
+		ev_timer_again(EV_A_ &(ctx->w_linger));
+	}
+}
+
 static void cleanup(EV_P_ ctx_t *ctx)
 {
-	ev_io_stop(EV_A_ &ctx->w_local_read);
-	ev_io_stop(EV_A_ &ctx->w_local_write);
-	ev_io_stop(EV_A_ &ctx->w_remote_read);
-	ev_io_stop(EV_A_ &ctx->w_remote_write);
+	PROBE4(relay_close, ctx->sock_local, ctx->sock_remote,
+	       ctx->tx_total, ctx->rx_total);
+	trace_span(ctx->trace, "relay", NULL);
+	trace_close(ctx->trace);
+	ev_timer_stop(EV_A_ &ctx->w_linger);
+	if (ctx->all_prev != NULL)
+	{
+		ctx->all_prev->all_next = ctx->all_next;
+	}
+	else
+	{
+		all_head = ctx->all_next;
+	}
+	if (ctx->all_next != NULL)
+	{
+		ctx->all_next->all_prev = ctx->all_prev;
+	}
 	close(ctx->sock_local);
 	close(ctx->sock_remote);
-	free(ctx);
+	// 边沿触发模式下，关闭 socket 后内核自动将其移出 epoll
+	if (epfd < 0)
+	{
+		ev_io_stop(EV_A_ &ctx->w_local_read);
+		ev_io_stop(EV_A_ &ctx->w_local_write);
+		ev_io_stop(EV_A_ &ctx->w_remote_read);
+		ev_io_stop(EV_A_ &ctx->w_remote_write);
+	}
+	if (busy(ctx))
+	{
+		// 仍在队列中或者 worker 线程仍在使用，稍后释放
+		ctx->dead = 1;
+		return;
+	}
+	release(ctx);
+}
+
+// 边沿触发模式：每个 socket 只在建立时注册一次，之后不再调用 epoll_ctl
+static void relay_edge(EV_P_ ctx_t *ctx)
+{
+	ctx->ep_local.ctx = ctx;
+	ctx->ep_local.fd = ctx->sock_local;
+	ctx->ep_local.ready = 0;
+	ctx->ep_remote.ctx = ctx;
+	ctx->ep_remote.fd = ctx->sock_remote;
+	ctx->ep_remote.ready = 0;
+	ctx->tx_job.evp = &(ctx->evp);
+	ctx->tx_job.crypt = crypto_encrypt;
+	ctx->tx_job.done = crypt_done;
+	ctx->tx_job.data = (void *)ctx;
+	ctx->rx_job.evp = &(ctx->evp);
+	ctx->rx_job.crypt = crypto_decrypt;
+	ctx->rx_job.done = crypt_done;
+	ctx->rx_job.data = (void *)ctx;
+	ctx->next = NULL;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = &(ctx->ep_local);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, ctx->sock_local, &ev) != 0)
+	{
+		ERROR("epoll_ctl");
+		cleanup(EV_A_ ctx);
+		return;
+	}
+	ev.data.ptr = &(ctx->ep_remote);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, ctx->sock_remote, &ev) != 0)
+	{
+		ERROR("epoll_ctl");
+		cleanup(EV_A_ ctx);
+		return;
+	}
+	// 注册时内核会报告当前的就绪状态，之后由 epoll_cb 驱动
+}
+
+static void epoll_cb(EV_P_ ev_io *w, int revents)
+{
+	UNUSED(w);
+	UNUSED(revents);
+
+	struct epoll_event events[MAX_EVENTS];
+	uint64_t begin = profile_now();
+	int n = epoll_wait(epfd, events, MAX_EVENTS, 0);
+	profile_end(PROF_SYSCALL, begin);
+	if (n < 0)
+	{
+		if (errno != EINTR)
+		{
+			ERROR("epoll_wait");
+		}
+		return;
+	}
+
+	// 先记录所有就绪状态，再统一转发，避免处理过程中释放的连接被再次访问
+	for (int i = 0; i < n; i++)
+	{
+		endpoint_t *ep = (endpoint_t *)events[i].data.ptr;
+		uint32_t e = events[i].events;
+		if (e & (EPOLLERR | EPOLLHUP))
+		{
+			// 由 recv/send 报告具体错误
+			ep->ready |= EPOLLIN | EPOLLOUT;
+		}
+		if (e & (EPOLLIN | EPOLLRDHUP))
+		{
+			ep->ready |= EPOLLIN;
+		}
+		if (e & EPOLLOUT)
+		{
+			ep->ready |= EPOLLOUT;
+		}
+		enqueue(ep->ctx);
+	}
+	run_queue(EV_A);
+}
+
+static void idle_cb(EV_P_ ev_idle *w, int revents)
+{
+	UNUSED(w);
+	UNUSED(revents);
+
+	run_queue(EV_A);
+}
+
+static void enqueue(ctx_t *ctx)
+{
+	if (!ctx->queued)
+	{
+		ctx->queued = 1;
+		ctx->next = NULL;
+		*run_tail = ctx;
+		run_tail = &(ctx->next);
+	}
+}
+
+// 处理当前队列中的连接，额度用完的连接重新入队，留到下一轮
+static void run_queue(EV_P)
+{
+	ctx_t *ctx = run_head;
+	run_head = NULL;
+	run_tail = &run_head;
+	while (ctx != NULL)
+	{
+		ctx_t *next = ctx->next;
+		ctx->queued = 0;
+		if (ctx->dead)
+		{
+			if (!busy(ctx))
+			{
+				release(ctx);
+			}
+		}
+		else
+		{
+			pump(EV_A_ ctx);
+		}
+		ctx = next;
+	}
+	if (run_head != NULL)
+	{
+		ev_idle_start(EV_A_ &w_idle);
+	}
+	else
+	{
+		ev_idle_stop(EV_A_ &w_idle);
+	}
+}
+
+// 从 src 读取、发往 dst，直到 EAGAIN 或额度用完
+// 出错返回 -1，额度用完返回 1，否则返回 0
+static int forward(endpoint_t *src, endpoint_t *dst, buf_t *buf,
+                   ssize_t *bytes, ssize_t *offset, int *eof,
+                   uint64_t *total, job_t *job, ssize_t *budget)
+{
+	int full = 0;
+	while (*budget > 0)
+	{
+		if (job->pending)
+		{
+			// 等待 worker 线程完成
+			return 0;
+		}
+		if (*bytes == 0)
+		{
+			if (*eof || !(src->ready & EPOLLIN))
+			{
+				return 0;
+			}
+			int eagain;
+			// 一次读取不超过剩余的额度，大缓冲区不会打破每轮的公平性
+			ssize_t n = fill(src->fd, buf, *budget, coalesce, &full, &eagain);
+			if (eagain)
+			{
+				src->ready &= ~EPOLLIN;
+			}
+			if (n < 0)
+			{
+				if (eagain)
+				{
+					return 0;
+				}
+				ERROR("recv");
+				return -1;
+			}
+			else if (n == 0)
+			{
+				// 把 FIN 转发给 dst，另一个方向继续转发
+				*eof = 1;
+				shutdown(dst->fd, SHUT_WR);
+				return 0;
+			}
+			*bytes = n;
+			*offset = 0;
+			*total += n;
+			if (offload)
+			{
+				job->buf = buf->data;
+				job->len = (size_t)n;
+				worker_submit(job);
+				return 0;
+			}
+			job->crypt(buf->data, (size_t)n, job->evp);
+		}
+		if (!(dst->ready & EPOLLOUT))
+		{
+			return 0;
+		}
+		if (coalesce && full)
+		{
+			// 读满了缓冲区，本轮很可能还要再发，先攒成完整的报文
+			cork(dst);
+		}
+		uint64_t begin = profile_now();
+		ssize_t n = send(dst->fd, buf->data + *offset, *bytes, MSG_NOSIGNAL);
+		profile_end(PROF_SYSCALL, begin);
+		PROBE2(relay_write, dst->fd, n);
+		if (n < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				PROBE1(relay_eagain, dst->fd);
+				dst->ready &= ~EPOLLOUT;
+				return 0;
+			}
+			ERROR("send");
+			return -1;
+		}
+		*offset += n;
+		*bytes -= n;
+		*budget -= n;
+	}
+	return 1;
+}
+
+static void pump(EV_P_ ctx_t *ctx)
+{
+	ssize_t tx_budget = BUDGET;
+	ssize_t rx_budget = BUDGET;
+	int eof = ctx->local_eof + ctx->remote_eof;
+	uint64_t tx_total = ctx->tx_total;
+	uint64_t rx_total = ctx->rx_total;
+
+	int tx = forward(&(ctx->ep_local), &(ctx->ep_remote), &(ctx->tx_buf),
+	                 &(ctx->tx_bytes), &(ctx->tx_offset), &(ctx->local_eof),
+	                 &(ctx->tx_total), &(ctx->tx_job), &tx_budget);
+	if (tx < 0)
+	{
+		cleanup(EV_A_ ctx);
+		return;
+	}
+	int rx = forward(&(ctx->ep_remote), &(ctx->ep_local), &(ctx->rx_buf),
+	                 &(ctx->rx_bytes), &(ctx->rx_offset), &(ctx->remote_eof),
+	                 &(ctx->rx_total), &(ctx->rx_job), &rx_budget);
+	if (rx < 0)
+	{
+		cleanup(EV_A_ ctx);
+		return;
+	}
+	if ((tx_total == 0) && (ctx->tx_total != 0))
+	{
+		trace_point(ctx->trace, "first tx byte");
+	}
+	if ((rx_total == 0) && (ctx->rx_total != 0))
+	{
+		trace_point(ctx->trace, "first rx byte");
+	}
+
+	if (ctx->local_eof && ctx->remote_eof)
+	{
+		cleanup(EV_A_ ctx);
+		return;
+	}
+	if (ctx->local_eof || ctx->remote_eof)
+	{
+		if ((eof != ctx->local_eof + ctx->remote_eof)
+		    || (tx_budget < BUDGET) || (rx_budget < BUDGET))
+		{
+			ev_timer_again(EV_A_ &(ctx->w_linger));
+		}
+	}
+	if ((tx > 0) || (rx > 0))
+	{
+		enqueue(ctx);
+	}
+}
+
+// 仍在队列中、等待推送或者有任务未完成的连接不能释放
+static int busy(const ctx_t *ctx)
+{
+	return ctx->queued || ctx->corked || ctx->tx_job.pending || ctx->rx_job.pending;
+}
+
+static void crypt_done(EV_P_ job_t *job)
+{
+	ctx_t *ctx = (ctx_t *)(job->data);
+	if (ctx->dead)
+	{
+		if (!busy(ctx))
+		{
+			release(ctx);
+		}
+		return;
+	}
+	// 由 run_queue 发送处理完的数据
+	enqueue(ctx);
+	ev_idle_start(EV_A_ &w_idle);
+}
+
+// 读取数据，返回值同 recv，eagain 表示 socket 已经读空，full 表示读满了缓冲区，
+// limit 非 0 时最多读取 limit 字节；drain 非 0 时连续读取直到缓冲区满或者 EAGAIN，把多次小的读合并为一次发送，
+// 边沿触发模式本来就要读到 EAGAIN，所以不会多出 recv
+static ssize_t fill(int fd, buf_t *buf, ssize_t limit, int drain, int *full, int *eagain)
+{
+	ssize_t size = (ssize_t)CLASS_SIZE(buf->cls);
+	if ((limit > 0) && (limit < size))
+	{
+		size = limit;
+	}
+	ssize_t n = 0;
+	*full = 0;
+	*eagain = 0;
+	do
+	{
+		uint64_t begin = profile_now();
+		ssize_t m = recv(fd, buf->data + n, size - n, 0);
+		profile_end(PROF_SYSCALL, begin);
+		PROBE2(relay_read, fd, m);
+		if (m < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				PROBE1(relay_eagain, fd);
+				*eagain = 1;
+			}
+		}
+		if (m <= 0)
+		{
+			if (n == 0)
+			{
+				return m;
+			}
+			// 已经读到数据，EOF 和错误留给下一次读取处理
+			break;
+		}
+		n += m;
+		__atomic_store_n(&(load.bytes), load.bytes + m, __ATOMIC_RELAXED);
+	} while (drain && (n < size));
+	*full = (n == size);
+	grow(buf, n);
+	return n;
+}
+
+// 在 ep 上设置 TCP_CORK，本轮迭代中之后的发送攒成完整的报文，
+// 由 flush_cb 解除，每轮迭代每个 socket 最多设置一次
+static void cork(endpoint_t *ep)
+{
+	ctx_t *ctx = ep->ctx;
+	int which = (ep == &(ctx->ep_local)) ? CORK_LOCAL : CORK_REMOTE;
+	if (ctx->corked & which)
+	{
+		return;
+	}
+	int on = 1;
+	if (setsockopt(ep->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) != 0)
+	{
+		return;
+	}
+	if (ctx->corked == 0)
+	{
+		ctx->cork_next = cork_head;
+		cork_head = ctx;
+	}
+	ctx->corked |= which;
+}
+
+// 本轮迭代结束，解除 TCP_CORK，内核立即发出积压的数据，
+// socket 恢复到未设置 TCP_CORK 的原始状态
+static void flush_cb(EV_P_ ev_prepare *w, int revents)
+{
+	UNUSED(loop);
+	UNUSED(w);
+	UNUSED(revents);
+
+	ctx_t *ctx = cork_head;
+	cork_head = NULL;
+	while (ctx != NULL)
+	{
+		ctx_t *next = ctx->cork_next;
+		int corked = ctx->corked;
+		ctx->corked = 0;
+		if (ctx->dead)
+		{
+			if (!busy(ctx))
+			{
+				release(ctx);
+			}
+		}
+		else
+		{
+			int off = 0;
+			if (corked & CORK_LOCAL)
+			{
+				setsockopt(ctx->sock_local, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+			}
+			if (corked & CORK_REMOTE)
+			{
+				setsockopt(ctx->sock_remote, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+			}
+		}
+		ctx = next;
+	}
 }
@@ -21,7 +21,44 @@
 #ifndef RELAY_H
 #define RELAY_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include "crypto.h"
-extern void relay(int local, int remote, crypto_evp_t *evp);
+#include "trace.h"
+
+// edge 非 0 时使用边沿触发的 epoll 转发数据，
+// threads 非 0 时由 threads 个 worker 线程加解密（同时启用边沿触发），
+// coalesce 非 0 时合并小块数据后再发送（同时启用边沿触发）
+extern int relay_init(int edge, int threads, int coalesce, int buffer_max);
+
+// 在另一个事件循环的线程中调用，为该循环建立自己的连接池和缓冲区，
+// 配置与 relay_init 相同
+extern int relay_loop_init(void);
+
+// 本线程事件循环的负载，由本线程更新，其他线程可以用原子操作读取
+typedef struct
+{
+	unsigned long active;	// 活动的连接数
+	uint64_t bytes;			// 累计读取的字节数
+} relay_load_t;
+
+extern relay_load_t *relay_load(void);
+
+// tag 由调用者指定（如 server_id），buf 为已经解密、需要先发往 local 的数据，
+// relay 接管 trace，tx 为 local 到 remote 的方向，rx 为 remote 到 local
+extern void relay(int local, int remote, int tag, crypto_evp_t *evp,
+                  const void *buf, size_t len, trace_t *trace);
+
+// 每个连接上保存的上一次采样的 TCP_INFO 计数，新连接为 0，
+// 供 relay_foreach 的调用者计算两次采样之间的增量
+typedef struct
+{
+	uint32_t retrans;
+	uint32_t segs;
+} relay_sample_t;
+
+// 对每个活动连接调用 cb，sock 为 remote 一端
+extern void relay_foreach(void (*cb)(int tag, int sock, relay_sample_t *last, void *data),
+                          void *data);
 
 #endif // RELAY_H
@@ -0,0 +1,194 @@
+/*
+ * sniff.c - TLS SNI / HTTP Host sniffing
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include "sniff.h"
+
+// 主机名只允许字母、数字、'-' 和 '.'
+static int set_host(char *host, const uint8_t *name, size_t len)
+{
+	if ((len == 0) || (len > 255))
+	{
+		return -1;
+	}
+	for (size_t i = 0; i < len; i++)
+	{
+		if (!isalnum(name[i]) && (name[i] != '-') && (name[i] != '.'))
+		{
+			return -1;
+		}
+	}
+	memcpy(host, name, len);
+	host[len] = '\0';
+	return 1;
+}
+
+#define U16(p) (((size_t)(p)[0] << 8) | (p)[1])
+
+// TLS ClientHello
+// +------+---------+--------+------+--------+---------+--------+-----+---------+-------------+-----+
+// | 0x16 | VERSION | LENGTH | 0x01 | LENGTH | VERSION | RANDOM | SID | CIPHERS | COMPRESSION | EXT |
+// +------+---------+--------+------+--------+---------+--------+-----+---------+-------------+-----+
+// |  1   |    2    |   2    |  1   |   3    |    2    |   32   | 1+n |   2+n   |     1+n     | 2+n |
+// +------+---------+--------+------+--------+---------+--------+-----+---------+-------------+-----+
+// 只解析第一个 TLS 记录
+static int sniff_tls(const uint8_t *buf, size_t len, char *host, size_t *want)
+{
+	if (len < 5)
+	{
+		return 0;
+	}
+	if (buf[1] != 0x03)
+	{
+		return -1;
+	}
+	size_t end = 5 + U16(buf + 3);
+	*want = end;
+	if (len < end)
+	{
+		return 0;
+	}
+	// 记录中至少要有握手消息的类型和长度
+	if ((end < 5 + 4) || (buf[5] != 0x01))
+	{
+		return -1;
+	}
+	const uint8_t *p = buf + 5 + 4 + 2 + 32;
+	const uint8_t *e = buf + end;
+	if (p + 1 > e)
+	{
+		return -1;
+	}
+	p += 1 + p[0];				// session id
+	if (p + 2 > e)
+	{
+		return -1;
+	}
+	p += 2 + U16(p);			// cipher suites
+	if (p + 1 > e)
+	{
+		return -1;
+	}
+	p += 1 + p[0];				// compression methods
+	if (p + 2 > e)
+	{
+		return -1;
+	}
+	size_t ext_len = U16(p);
+	p += 2;
+	if (p + ext_len < e)
+	{
+		e = p + ext_len;
+	}
+	while (p + 4 <= e)
+	{
+		size_t type = U16(p);
+		size_t n = U16(p + 2);
+		p += 4;
+		if (p + n > e)
+		{
+			return -1;
+		}
+		if (type == 0x0000)
+		{
+			// server_name: list length, name type (0 为主机名), name length, name
+			if ((n < 5) || (p[2] != 0x00) || (5 + U16(p + 3) > n))
+			{
+				return -1;
+			}
+			return set_host(host, p + 5, U16(p + 3));
+		}
+		p += n;
+	}
+	return -1;
+}
+
+// HTTP 请求：方法之后查找 Host 头，去掉端口
+static int sniff_http(const uint8_t *buf, size_t len, char *host)
+{
+	size_t i = 0;
+	while ((i < len) && (i < 16) && isupper(buf[i]))
+	{
+		i++;
+	}
+	if (i == len)
+	{
+		return 0;
+	}
+	if ((i == 0) || (i == 16) || (buf[i] != ' '))
+	{
+		return -1;
+	}
+	const char *p = (const char *)buf;
+	const char *e = p + len;
+	for (;;)
+	{
+		const char *eol = memchr(p, '\n', e - p);
+		if (eol == NULL)
+		{
+			return 0;
+		}
+		p = eol + 1;
+		if ((p < e) && ((*p == '\r') || (*p == '\n')))
+		{
+			// 请求头结束，没有 Host
+			return -1;
+		}
+		if ((e - p >= 5) && (strncasecmp(p, "host:", 5) == 0))
+		{
+			p += 5;
+			eol = memchr(p, '\n', e - p);
+			if (eol == NULL)
+			{
+				return 0;
+			}
+			while ((p < eol) && ((*p == ' ') || (*p == '\t')))
+			{
+				p++;
+			}
+			const char *q = p;
+			while ((q < eol) && (*q != ':') && (*q != '\r') && (*q != ' '))
+			{
+				q++;
+			}
+			return set_host(host, (const uint8_t *)p, q - p);
+		}
+	}
+}
+
+// 从客户端的第一批数据中找出目标主机名
+// 返回 1 表示找到，-1 表示无法识别，0 表示数据不完整，
+// 此时 *want 为需要的字节数，未知时为 0
+int sniff_host(const uint8_t *buf, size_t len, char *host, size_t *want)
+{
+	*want = 0;
+	if (len == 0)
+	{
+		return 0;
+	}
+	if (buf[0] == 0x16)
+	{
+		return sniff_tls(buf, len, host, want);
+	}
+	return sniff_http(buf, len, host);
+}
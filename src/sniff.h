@@ -0,0 +1,28 @@
+/*
+ * sniff.h - TLS SNI / HTTP Host sniffing
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SNIFF_H
+#define SNIFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern int sniff_host(const uint8_t *buf, size_t len, char *host, size_t *want);
+
+#endif // SNIFF_H
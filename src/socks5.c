@@ -50,7 +50,8 @@ typedef struct
 	int sock;
 	state_t state;
 	int len;
-	void (*cb)(int, char *, char *);
+	void (*cb)(int, char *, char *, double);
+	double start;
 	ev_io w_read;
 	ev_io w_write;
 	char host[257];
@@ -61,9 +62,9 @@ typedef struct
 static void socks5_send_cb(EV_P_ ev_io *w, int revents);
 static void socks5_recv_cb(EV_P_ ev_io *w, int revents);
 
-extern struct ev_loop *loop;
+extern __thread struct ev_loop *loop;
 
-void socks5_accept(int sock, void (*cb)(int, char *, char *))
+void socks5_accept(int sock, void (*cb)(int, char *, char *, double))
 {
 	ctx_t *ctx = (ctx_t *)malloc(sizeof(ctx_t));
 	if (ctx == NULL)
@@ -74,6 +75,7 @@ void socks5_accept(int sock, void (*cb)(int, char *, char *))
 	}
 	ctx->sock = sock;
 	ctx->cb = cb;
+	ctx->start = ev_time();
 	ctx->state = CLOSED;
 
 	ev_io_init(&(ctx->w_read), socks5_recv_cb, ctx->sock, EV_READ);
@@ -285,7 +287,7 @@ static void socks5_send_cb(EV_P_ ev_io *w, int revents)
 	{
 		if (ctx->state == REQ_RCVD)
 		{
-			(ctx->cb)(ctx->sock, ctx->host, ctx->port);
+			(ctx->cb)(ctx->sock, ctx->host, ctx->port, ctx->start);
 			free(ctx);
 		}
 		else
@@ -22,6 +22,7 @@
 
 #include <sys/socket.h>
 
-extern void socks5_accept(int sock, void (*cb)(int, char *host, char *port));
+// start 为接受连接的时刻（ev_time()）
+extern void socks5_accept(int sock, void (*cb)(int, char *host, char *port, double start));
 
 #endif
@@ -0,0 +1,221 @@
+/*
+ * telemetry.c - per-server path telemetry from TCP_INFO
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ev.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "conf.h"
+#include "log.h"
+#include "relay.h"
+#include "telemetry.h"
+
+#define UNUSED(x) do {(void)(x);} while (0)
+
+// EWMA 中新样本的权重
+#define ALPHA 0.25
+
+// 丢包率对权重的影响：score = rtt * (1 + LOSS_PENALTY * loss)
+#define LOSS_PENALTY 20.0
+
+// 权重的下限，路径再差的 server 也保留被选中的机会
+#define MIN_WEIGHT (1.0 / 16)
+
+// tcpi_state 的取值，定义在 <netinet/tcp.h> 中，但它与 <linux/tcp.h> 冲突
+#ifndef TCP_ESTABLISHED
+#  define TCP_ESTABLISHED 1
+#endif
+
+typedef struct
+{
+	int valid;
+	double rtt;        // 平滑 RTT，毫秒
+	double loss;       // 重传的报文比例
+	double rate;       // 发送速率，字节/秒
+	double cwnd;       // 拥塞窗口，报文数
+	unsigned samples;  // 最近一轮采样的连接数
+} path_t;
+
+// 一轮采样的累加值
+typedef struct
+{
+	unsigned n;
+	double rtt;
+	double cwnd;
+	double retrans;
+	double segs;
+	unsigned rate_n;
+	double rate;
+} round_t;
+
+static void sample_cb(EV_P_ ev_timer *w, int revents);
+static void stats_cb(EV_P_ ev_signal *w, int revents);
+static void sample(int tag, int sock, relay_sample_t *last, void *data);
+
+extern __thread struct ev_loop *loop;
+
+static const conf_t *config;
+static path_t paths[MAX_SERVER];
+static ev_timer w_sample;
+static ev_signal w_stats;
+
+void telemetry_init(const conf_t *conf)
+{
+	config = conf;
+	bzero(paths, sizeof(paths));
+	if (conf->telemetry <= 0)
+	{
+		return;
+	}
+	ev_timer_init(&w_sample, sample_cb, conf->telemetry, conf->telemetry);
+	ev_timer_start(EV_A_ &w_sample);
+	ev_signal_init(&w_stats, stats_cb, SIGUSR1);
+	ev_signal_start(EV_A_ &w_stats);
+}
+
+static void ewma(double *avg, double x, int valid)
+{
+	*avg = valid ? *avg + ALPHA * (x - *avg) : x;
+}
+
+static void sample_cb(EV_P_ ev_timer *w, int revents)
+{
+	UNUSED(loop);
+	UNUSED(w);
+	UNUSED(revents);
+
+	round_t rounds[MAX_SERVER];
+	bzero(rounds, sizeof(rounds));
+	relay_foreach(sample, rounds);
+	for (int i = 0; i < config->server_num; i++)
+	{
+		round_t *r = &rounds[i];
+		path_t *p = &paths[i];
+		p->samples = r->n;
+		if (r->n == 0)
+		{
+			// 没有活动连接，保留之前的数据
+			continue;
+		}
+		ewma(&(p->rtt), r->rtt / r->n, p->valid);
+		ewma(&(p->cwnd), r->cwnd / r->n, p->valid);
+		if (r->segs > 0)
+		{
+			// 本轮没有发送数据时不能说明丢包情况，保留之前的值
+			ewma(&(p->loss), r->retrans / r->segs, p->valid);
+		}
+		if (r->rate_n > 0)
+		{
+			ewma(&(p->rate), r->rate / r->rate_n, p->valid && (p->rate > 0));
+		}
+		p->valid = 1;
+	}
+}
+
+// tag 为 server_id，sock 为到 ioserver 的连接
+// 丢包率只计本轮采样间隔内的增量，否则长连接的历史计数会掩盖最近的丢包
+static void sample(int tag, int sock, relay_sample_t *last, void *data)
+{
+	round_t *rounds = (round_t *)data;
+	if ((tag < 0) || (tag >= config->server_num))
+	{
+		return;
+	}
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	bzero(&info, sizeof(info));
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+	{
+		return;
+	}
+	if (info.tcpi_state != TCP_ESTABLISHED)
+	{
+		return;
+	}
+	round_t *r = &rounds[tag];
+	r->n++;
+	r->rtt += info.tcpi_rtt / 1000.0;
+	r->cwnd += info.tcpi_snd_cwnd;
+	r->retrans += (uint32_t)(info.tcpi_total_retrans - last->retrans);
+	r->segs += (uint32_t)(info.tcpi_segs_out - last->segs);
+	last->retrans = info.tcpi_total_retrans;
+	last->segs = info.tcpi_segs_out;
+	// 旧内核不提供 tcpi_delivery_rate，受应用限制的样本不能反映路径容量
+	if ((len >= offsetof(struct tcp_info, tcpi_delivery_rate) + sizeof(info.tcpi_delivery_rate))
+	    && !info.tcpi_delivery_rate_app_limited && (info.tcpi_delivery_rate > 0))
+	{
+		r->rate_n++;
+		r->rate += (double)info.tcpi_delivery_rate;
+	}
+}
+
+double telemetry_weight(int server_id, unsigned healthy)
+{
+	if (!paths[server_id].valid)
+	{
+		return 1.0;
+	}
+	// 与可用的 server 中最好的相比，得分越高权重越低，
+	// 不可用的 server 不参与比较，否则它下线后其余 server 的权重都会偏低
+	double best = 0.0;
+	for (int i = 0; i < config->server_num; i++)
+	{
+		if (paths[i].valid && (healthy & (1u << i)))
+		{
+			double score = (paths[i].rtt + 1.0) * (1.0 + LOSS_PENALTY * paths[i].loss);
+			if ((best == 0.0) || (score < best))
+			{
+				best = score;
+			}
+		}
+	}
+	if (best == 0.0)
+	{
+		return 1.0;
+	}
+	path_t *p = &paths[server_id];
+	double weight = best / ((p->rtt + 1.0) * (1.0 + LOSS_PENALTY * p->loss));
+	return (weight < MIN_WEIGHT) ? MIN_WEIGHT : weight;
+}
+
+static void stats_cb(EV_P_ ev_signal *w, int revents)
+{
+	UNUSED(loop);
+	UNUSED(w);
+	UNUSED(revents);
+
+	for (int i = 0; i < config->server_num; i++)
+	{
+		path_t *p = &paths[i];
+		if (!p->valid)
+		{
+			LOG("server %s:%s: no data", config->server[i].address, config->server[i].port);
+			continue;
+		}
+		// 这里的权重与所有 server 相比，不考虑当前是否可用
+		LOG("server %s:%s: rtt %.1f ms, retrans %.2f%%, rate %.0f KB/s, cwnd %.0f, "
+		    "%u connections, weight %.2f",
+		    config->server[i].address, config->server[i].port,
+		    p->rtt, p->loss * 100.0, p->rate / 1024.0, p->cwnd,
+		    p->samples, telemetry_weight(i, ~0u));
+	}
+}
@@ -0,0 +1,32 @@
+/*
+ * telemetry.h - per-server path telemetry from TCP_INFO
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "conf.h"
+
+// 每 conf->telemetry 秒对所有到 ioserver 的连接采样一次
+extern void telemetry_init(const conf_t *conf);
+
+// 返回 server 的权重，范围 [1/16, 1]，没有数据时返回 1
+// healthy 为可用 server 的位图，只与其中路径质量最好的 server 相比
+extern double telemetry_weight(int server_id, unsigned healthy);
+
+#endif // TELEMETRY_H
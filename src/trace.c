@@ -0,0 +1,186 @@
+/*
+ * trace.c - sampled connection tracing in Chrome trace event format
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ev.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+#include "trace.h"
+
+// 文件超过该大小后改名为 <file>.1，重新开始记录
+#define TRACE_MAX_SIZE (64 * 1024 * 1024)
+
+struct trace
+{
+	unsigned long long id;
+	double start;
+	double mark;
+};
+
+// 多个事件循环线程共用一个文件
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char trace_file[128];
+static FILE *f = NULL;
+static long size = 0;
+static int sample_rate = 0;
+static unsigned long long count = 0;
+static int pid;
+
+static int trace_open(void)
+{
+	f = fopen(trace_file, "w");
+	if (f == NULL)
+	{
+		ERROR("fopen");
+		return -1;
+	}
+	// JSON Array Format，结尾的 ']' 可以省略，文件随时可以打开
+	size = fprintf(f, "[\n");
+	return 0;
+}
+
+int trace_init(const char *file, int sample)
+{
+	if ((file[0] == '\0') || (sample <= 0))
+	{
+		return 0;
+	}
+	strncpy(trace_file, file, sizeof(trace_file) - 1);
+	trace_file[sizeof(trace_file) - 1] = '\0';
+	sample_rate = sample;
+	pid = (int)getpid();
+	return trace_open();
+}
+
+trace_t *trace_new(double start)
+{
+	pthread_mutex_lock(&lock);
+	int skip = (f == NULL) || (count++ % sample_rate != 0);
+	unsigned long long id = count;
+	pthread_mutex_unlock(&lock);
+	if (skip)
+	{
+		return NULL;
+	}
+	trace_t *trace = (trace_t *)malloc(sizeof(trace_t));
+	if (trace == NULL)
+	{
+		return NULL;
+	}
+	trace->id = id;
+	trace->start = start;
+	trace->mark = start;
+	return trace;
+}
+
+static void escape(char *dst, size_t len, const char *src)
+{
+	size_t i = 0;
+	for (; (*src != '\0') && (i + 7 < len); src++)
+	{
+		unsigned char c = (unsigned char)*src;
+		if ((c == '"') || (c == '\\'))
+		{
+			dst[i++] = '\\';
+			dst[i++] = c;
+		}
+		else if (c < 0x20)
+		{
+			i += sprintf(dst + i, "\\u%04x", c);
+		}
+		else
+		{
+			dst[i++] = c;
+		}
+	}
+	dst[i] = '\0';
+}
+
+static void emit(const trace_t *trace, const char *name, const char *arg,
+                 double start, double end)
+{
+	char detail[1024];
+	escape(detail, sizeof(detail), arg == NULL ? "" : arg);
+	pthread_mutex_lock(&lock);
+	if (f == NULL)
+	{
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	if (size > TRACE_MAX_SIZE)
+	{
+		char old[sizeof(trace_file) + 2];
+		fclose(f);
+		f = NULL;
+		sprintf(old, "%s.1", trace_file);
+		rename(trace_file, old);
+		if (trace_open() != 0)
+		{
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+	}
+	int n = fprintf(f, "{\"name\":\"%s\",\"cat\":\"iosocks\",\"ph\":\"X\","
+	                "\"ts\":%.0f,\"dur\":%.0f,\"pid\":%d,\"tid\":%llu,"
+	                "\"args\":{\"detail\":\"%s\"}},\n",
+	                name, start * 1e6, (end - start) * 1e6, pid,
+	                trace->id, detail);
+	if (n > 0)
+	{
+		size += n;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void trace_span(trace_t *trace, const char *name, const char *arg)
+{
+	if (trace != NULL)
+	{
+		double now = ev_time();
+		emit(trace, name, arg, trace->mark, now);
+		trace->mark = now;
+	}
+}
+
+void trace_point(trace_t *trace, const char *name)
+{
+	if (trace != NULL)
+	{
+		emit(trace, name, NULL, trace->mark, ev_time());
+	}
+}
+
+void trace_close(trace_t *trace)
+{
+	if (trace != NULL)
+	{
+		emit(trace, "connection", NULL, trace->start, ev_time());
+		pthread_mutex_lock(&lock);
+		if (f != NULL)
+		{
+			fflush(f);
+		}
+		pthread_mutex_unlock(&lock);
+		free(trace);
+	}
+}
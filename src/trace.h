@@ -0,0 +1,41 @@
+/*
+ * trace.h - sampled connection tracing in Chrome trace event format
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+typedef struct trace trace_t;
+
+// 每 sample 个连接记录一个，file 为空字符串时不启用
+extern int trace_init(const char *file, int sample);
+
+// 连接在 start 时刻（ev_time()）开始，未被采样时返回 NULL，
+// 以下函数均接受 NULL
+extern trace_t *trace_new(double start);
+
+// 记录上一阶段结束到现在的阶段，arg 可以为 NULL
+extern void trace_span(trace_t *trace, const char *name, const char *arg);
+
+// 同 trace_span，但不结束当前阶段
+extern void trace_point(trace_t *trace, const char *name);
+
+// 记录整个连接并释放
+extern void trace_close(trace_t *trace);
+
+#endif // TRACE_H
@@ -0,0 +1,190 @@
+/*
+ * users.c - multi-user key table
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "log.h"
+#include "md5.h"
+#include "users.h"
+
+#define MAX_LINE 1024
+
+// 开放寻址的哈希表，uid 为 0 表示空位
+typedef struct
+{
+	uint32_t uid;
+	uint8_t key[16];
+} entry_t;
+
+struct users
+{
+	size_t count;
+	size_t mask;
+	entry_t *table;
+};
+
+static size_t hash(uint32_t uid, size_t mask)
+{
+	return (size_t)(uid * 2654435761u) & mask;
+}
+
+static int insert(users_t *users, uint32_t uid, const char *key)
+{
+	size_t i = hash(uid, users->mask);
+	while (users->table[i].uid != 0)
+	{
+		if (users->table[i].uid == uid)
+		{
+			return -1;
+		}
+		i = (i + 1) & users->mask;
+	}
+	users->table[i].uid = uid;
+	md5(users->table[i].key, key, strlen(key));
+	users->count++;
+	return 0;
+}
+
+// 密钥文件每行一个用户：<uid> <key>，以 '#' 或 ';' 开头的行为注释
+users_t *users_load(const char *file)
+{
+	FILE *f = fopen(file, "rb");
+	if (f == NULL)
+	{
+		LOG("failed to read users file %s", file);
+		return NULL;
+	}
+
+	// 先数出行数，哈希表的负载因子不超过 1/2
+	size_t lines = 0;
+	int c;
+	while ((c = fgetc(f)) != EOF)
+	{
+		if (c == '\n')
+		{
+			lines++;
+		}
+	}
+	rewind(f);
+	size_t size = 16;
+	while (size < (lines + 1) * 2)
+	{
+		size *= 2;
+	}
+
+	users_t *users = (users_t *)malloc(sizeof(users_t));
+	if (users == NULL)
+	{
+		LOG("out of memory");
+		fclose(f);
+		return NULL;
+	}
+	users->count = 0;
+	users->mask = size - 1;
+	users->table = (entry_t *)calloc(size, sizeof(entry_t));
+	if (users->table == NULL)
+	{
+		LOG("out of memory");
+		free(users);
+		fclose(f);
+		return NULL;
+	}
+
+	int line_num = 0;
+	char buf[MAX_LINE];
+	while (fgets(buf, MAX_LINE, f) != NULL)
+	{
+		line_num++;
+		char *line = buf;
+		// 跳过行首空白符
+		while (isspace(*line))
+		{
+			line++;
+		}
+		// 去除行尾的空白符
+		char *end = line + strlen(line) - 1;
+		while ((end >= line) && (isspace(*end)))
+		{
+			*end = '\0';
+			end--;
+		}
+		// 跳过注释和空白行
+		if ((*line == ';') || (*line == '#') || (*line == '\0'))
+		{
+			continue;
+		}
+		char *key;
+		unsigned long uid = strtoul(line, &key, 10);
+		if ((key == line) || !isspace(*key) || (uid == 0) || (uid > UINT32_MAX))
+		{
+			LOG("%s line %d: bad uid", file, line_num);
+			users_free(users);
+			fclose(f);
+			return NULL;
+		}
+		while (isspace(*key))
+		{
+			key++;
+		}
+		if (insert(users, (uint32_t)uid, key) != 0)
+		{
+			LOG("%s line %d: duplicate uid %lu", file, line_num, uid);
+			users_free(users);
+			fclose(f);
+			return NULL;
+		}
+	}
+	fclose(f);
+	return users;
+}
+
+void users_free(users_t *users)
+{
+	if (users != NULL)
+	{
+		free(users->table);
+		free(users);
+	}
+}
+
+const void *users_key(const users_t *users, uint32_t uid)
+{
+	if (uid == 0)
+	{
+		return NULL;
+	}
+	size_t i = hash(uid, users->mask);
+	while (users->table[i].uid != 0)
+	{
+		if (users->table[i].uid == uid)
+		{
+			return users->table[i].key;
+		}
+		i = (i + 1) & users->mask;
+	}
+	return NULL;
+}
+
+size_t users_count(const users_t *users)
+{
+	return users->count;
+}
@@ -0,0 +1,33 @@
+/*
+ * users.h - multi-user key table
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef USERS_H
+#define USERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct users users_t;
+
+extern users_t *users_load(const char *file);
+extern void users_free(users_t *users);
+extern const void *users_key(const users_t *users, uint32_t uid);
+extern size_t users_count(const users_t *users);
+
+#endif // USERS_H
@@ -24,6 +24,8 @@
 #include <linux/if.h>
 #include <linux/netfilter_ipv4.h>
 #include <linux/netfilter_ipv6/ip6_tables.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pwd.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -34,24 +36,17 @@
 #include <unistd.h>
 #include "utils.h"
 
+#ifndef IP_TRANSPARENT
+#  define IP_TRANSPARENT 19
+#endif
+#ifndef IPV6_TRANSPARENT
+#  define IPV6_TRANSPARENT 75
+#endif
+
 #ifndef IP6T_SO_ORIGINAL_DST
 #  define IP6T_SO_ORIGINAL_DST 80
 #endif
 
-ssize_t rand_bytes(void *stream, size_t len)
-{
-	static int urand = -1;
-	if (urand == -1)
-	{
-		urand = open("/dev/urandom", O_RDONLY, 0);
-	}
-	if (urand < 0)
-	{
-		return -1;
-	}
-	return read(urand, stream, len);
-}
-
 int setnonblock(int fd)
 {
 	int flags;
@@ -101,6 +96,16 @@ int setkeepalive(int fd)
 	return 0;
 }
 
+int setdeferaccept(int fd)
+{
+	int timeout = 10;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout, sizeof(int)) != 0)
+	{
+		return -1;
+	}
+	return 0;
+}
+
 int getdestaddr(int fd, struct sockaddr *addr, socklen_t *addrlen)
 {
 	if (getsockopt(fd, SOL_IPV6, IP6T_SO_ORIGINAL_DST, addr, addrlen) == 0)
@@ -114,6 +119,17 @@ int getdestaddr(int fd, struct sockaddr *addr, socklen_t *addrlen)
 	return -1;
 }
 
+// TPROXY 需要监听 socket 设置 IP_TRANSPARENT，需要 CAP_NET_ADMIN
+int settransparent(int fd, int family)
+{
+	int opt = 1;
+	if (family == AF_INET6)
+	{
+		return setsockopt(fd, SOL_IPV6, IPV6_TRANSPARENT, &opt, sizeof(opt));
+	}
+	return setsockopt(fd, SOL_IP, IP_TRANSPARENT, &opt, sizeof(opt));
+}
+
 int getsockerror(int fd)
 {
 	int error = 0;
@@ -22,12 +22,13 @@
 
 #include <sys/socket.h>
 
-extern ssize_t rand_bytes(void *stream, size_t len);
 extern int setnonblock(int fd);
 extern int settimeout(int fd);
 extern int setreuseaddr(int fd);
 extern int setkeepalive(int fd);
+extern int setdeferaccept(int fd);
 extern int getdestaddr(int fd, struct sockaddr *addr, socklen_t *addrlen);
+extern int settransparent(int fd, int family);
 extern int getsockerror(int fd);
 extern int runas(const char *user);
 extern int daemonize(const char *pidfile, const char *logfile);
@@ -0,0 +1,231 @@
+/*
+ * watchdog.c - event loop stall watchdog
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ev.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "log.h"
+#include "watchdog.h"
+
+#define UNUSED(x) do {(void)(x);} while (0)
+
+// 用于打断事件循环线程、抓取调用栈的信号
+#define SIG_BACKTRACE SIGUSR2
+
+// 调用栈最大深度
+#define MAX_FRAMES 32
+
+// 直方图的桶数，第 i 个桶统计耗时在 [2^i, 2^(i+1)) 微秒之间的迭代，
+// 第 0 个桶包括不到 1 微秒的迭代
+#define BUCKETS 32
+
+static void check_cb(EV_P_ ev_check *w, int revents);
+static void prepare_cb(EV_P_ ev_prepare *w, int revents);
+static void stats_cb(EV_P_ ev_signal *w, int revents);
+static void backtrace_handler(int signo);
+static void *watchdog_main(void *arg);
+static uint64_t now_us(void);
+
+extern __thread struct ev_loop *loop;
+
+static uint64_t threshold_us;
+static pthread_t loop_thread;
+
+// 心跳：当前迭代开始处理事件的时刻，0 表示事件循环正在等待事件
+static uint64_t busy_since;
+static uint64_t iteration = 1;
+
+// 由信号处理函数在事件循环线程中写入，prepare_cb 中读取
+static void *frames[MAX_FRAMES];
+static volatile sig_atomic_t frame_count = 0;
+
+static uint64_t histogram[BUCKETS];
+static uint64_t stalls = 0;
+static uint64_t max_stall = 0;
+
+static ev_check w_check;
+static ev_prepare w_prepare;
+static ev_signal w_stats;
+
+int watchdog_init(int threshold)
+{
+	if (threshold <= 0)
+	{
+		return 0;
+	}
+	threshold_us = (uint64_t)threshold * 1000;
+	loop_thread = pthread_self();
+	bzero(histogram, sizeof(histogram));
+
+	// backtrace() 第一次调用时可能加载 libgcc，先在信号处理函数之外调用一次
+	backtrace(frames, MAX_FRAMES);
+	struct sigaction sa;
+	bzero(&sa, sizeof(sa));
+	sa.sa_handler = backtrace_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIG_BACKTRACE, &sa, NULL);
+
+	// check 最先执行、prepare 最后执行，两者之间即为处理事件的耗时
+	ev_check_init(&w_check, check_cb);
+	ev_set_priority(&w_check, EV_MAXPRI);
+	ev_check_start(EV_A_ &w_check);
+	ev_prepare_init(&w_prepare, prepare_cb);
+	ev_set_priority(&w_prepare, EV_MINPRI);
+	ev_prepare_start(EV_A_ &w_prepare);
+	ev_signal_init(&w_stats, stats_cb, SIGUSR1);
+	ev_signal_start(EV_A_ &w_stats);
+
+	// 进入事件循环之前的初始化也在监视范围内
+	__atomic_store_n(&busy_since, now_us(), __ATOMIC_RELEASE);
+
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_t tid;
+	int ret = pthread_create(&tid, NULL, watchdog_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0)
+	{
+		ERROR("pthread_create");
+		return -1;
+	}
+	pthread_detach(tid);
+	return 0;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void check_cb(EV_P_ ev_check *w, int revents)
+{
+	UNUSED(loop);
+	UNUSED(w);
+	UNUSED(revents);
+
+	frame_count = 0;
+	__atomic_add_fetch(&iteration, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&busy_since, now_us(), __ATOMIC_RELEASE);
+}
+
+static void prepare_cb(EV_P_ ev_prepare *w, int revents)
+{
+	UNUSED(loop);
+	UNUSED(w);
+	UNUSED(revents);
+
+	uint64_t since = __atomic_exchange_n(&busy_since, 0, __ATOMIC_ACQ_REL);
+	if (since == 0)
+	{
+		return;
+	}
+	uint64_t t = now_us() - since;
+	int i = 0;
+	while ((i < BUCKETS - 1) && (t >> (i + 1)) != 0)
+	{
+		i++;
+	}
+	histogram[i]++;
+	if (t < threshold_us)
+	{
+		return;
+	}
+
+	stalls++;
+	if (t > max_stall)
+	{
+		max_stall = t;
+	}
+	LOG("event loop stalled for %.1f ms", t / 1000.0);
+	if (frame_count > 0)
+	{
+		char **symbols = backtrace_symbols(frames, frame_count);
+		if (symbols != NULL)
+		{
+			for (int j = 0; j < frame_count; j++)
+			{
+				LOG("  #%d %s", j, symbols[j]);
+			}
+			free(symbols);
+		}
+		frame_count = 0;
+	}
+}
+
+static void stats_cb(EV_P_ ev_signal *w, int revents)
+{
+	UNUSED(loop);
+	UNUSED(w);
+	UNUSED(revents);
+
+	LOG("watchdog: %llu stalls, longest %.1f ms",
+	    (unsigned long long)stalls, max_stall / 1000.0);
+	for (int i = 0; i < BUCKETS; i++)
+	{
+		if (histogram[i] != 0)
+		{
+			LOG("  iteration %8llu us .. %8llu us: %llu",
+			    (i == 0) ? 0ULL : 1ULL << i, (1ULL << (i + 1)) - 1,
+			    (unsigned long long)histogram[i]);
+		}
+	}
+}
+
+// 在事件循环线程中执行，只调用 backtrace()
+static void backtrace_handler(int signo)
+{
+	UNUSED(signo);
+
+	if (frame_count == 0)
+	{
+		frame_count = backtrace(frames, MAX_FRAMES);
+	}
+}
+
+static void *watchdog_main(void *arg)
+{
+	UNUSED(arg);
+
+	uint64_t reported = 0;
+	struct timespec interval;
+	interval.tv_sec = threshold_us / 4 / 1000000;
+	interval.tv_nsec = (long)(threshold_us / 4 % 1000000) * 1000;
+	for (;;)
+	{
+		nanosleep(&interval, NULL);
+		uint64_t since = __atomic_load_n(&busy_since, __ATOMIC_ACQUIRE);
+		uint64_t seq = __atomic_load_n(&iteration, __ATOMIC_RELAXED);
+		if ((since != 0) && (seq != reported) && (now_us() - since >= threshold_us))
+		{
+			// 每次卡顿只抓取一次调用栈，抓取的是卡顿仍在进行时的现场
+			reported = seq;
+			pthread_kill(loop_thread, SIG_BACKTRACE);
+		}
+	}
+	return NULL;
+}
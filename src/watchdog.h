@@ -0,0 +1,27 @@
+/*
+ * watchdog.h - event loop stall watchdog
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+// 事件循环一次迭代超过 threshold 毫秒时记录卡顿并抓取调用栈，
+// threshold 为 0 时不启用
+extern int watchdog_init(int threshold);
+
+#endif // WATCHDOG_H
@@ -0,0 +1,150 @@
+/*
+ * worker.c - crypto worker threads
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <ev.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "log.h"
+#include "profile.h"
+#include "worker.h"
+
+#define UNUSED(x) do {(void)(x);} while (0)
+
+static void *worker_main(void *arg);
+static void done_cb(EV_P_ ev_io *w, int revents);
+
+extern __thread struct ev_loop *loop;
+
+// 待处理的任务，先进先出
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static job_t *job_head = NULL;
+static job_t **job_tail = &job_head;
+
+// 已完成的任务，通过 eventfd 通知事件循环
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static job_t *done_head = NULL;
+static int efd = -1;
+static ev_io w_done;
+
+int worker_init(int threads)
+{
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0)
+	{
+		ERROR("eventfd");
+		return -1;
+	}
+	ev_io_init(&w_done, done_cb, efd, EV_READ);
+	ev_io_start(EV_A_ &w_done);
+
+	// worker 线程屏蔽所有信号，信号只由事件循环线程处理
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (int i = 0; i < threads; i++)
+	{
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, worker_main, NULL) != 0)
+		{
+			ERROR("pthread_create");
+			pthread_sigmask(SIG_SETMASK, &old, NULL);
+			return -1;
+		}
+		pthread_detach(tid);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return 0;
+}
+
+// 同一个 crypto_evp_t 同一方向同时只能有一个任务，以保证数据的顺序
+void worker_submit(job_t *job)
+{
+	assert(!job->pending);
+	job->pending = 1;
+	job->next = NULL;
+	pthread_mutex_lock(&job_lock);
+	*job_tail = job;
+	job_tail = &(job->next);
+	pthread_cond_signal(&job_cond);
+	pthread_mutex_unlock(&job_lock);
+}
+
+static void *worker_main(void *arg)
+{
+	UNUSED(arg);
+
+	profile_thread("worker");
+	for (;;)
+	{
+		pthread_mutex_lock(&job_lock);
+		while (job_head == NULL)
+		{
+			pthread_cond_wait(&job_cond, &job_lock);
+		}
+		job_t *job = job_head;
+		job_head = job->next;
+		if (job_head == NULL)
+		{
+			job_tail = &job_head;
+		}
+		pthread_mutex_unlock(&job_lock);
+
+		job->crypt(job->buf, job->len, job->evp);
+
+		pthread_mutex_lock(&done_lock);
+		job->next = done_head;
+		done_head = job;
+		pthread_mutex_unlock(&done_lock);
+		uint64_t one = 1;
+		if (write(efd, &one, sizeof(one)) < 0)
+		{
+			// 计数器溢出之前事件循环一定会读取，不会出错
+		}
+	}
+	return NULL;
+}
+
+static void done_cb(EV_P_ ev_io *w, int revents)
+{
+	UNUSED(w);
+	UNUSED(revents);
+
+	uint64_t count;
+	if (read(efd, &count, sizeof(count)) < 0)
+	{
+		return;
+	}
+	pthread_mutex_lock(&done_lock);
+	job_t *job = done_head;
+	done_head = NULL;
+	pthread_mutex_unlock(&done_lock);
+	while (job != NULL)
+	{
+		job_t *next = job->next;
+		job->pending = 0;
+		job->done(EV_A_ job);
+		job = next;
+	}
+}
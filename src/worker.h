@@ -0,0 +1,47 @@
+/*
+ * worker.h - crypto worker threads
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <ev.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "crypto.h"
+
+typedef struct job job_t;
+
+// 一次加密或解密任务，由事件循环线程提交，worker 线程执行，
+// 完成后在事件循环线程中调用 done
+struct job
+{
+	job_t *next;
+	int pending;
+	uint8_t *buf;
+	size_t len;
+	crypto_evp_t *evp;
+	void (*crypt)(void *buf, size_t len, crypto_evp_t *evp);
+	void (*done)(EV_P_ job_t *job);
+	void *data;
+};
+
+extern int worker_init(int threads);
+extern void worker_submit(job_t *job);
+
+#endif // WORKER_H
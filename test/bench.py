@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+
+# 劣化链路下的转发压测：经 ioclient、shim.py、ioserver 从本地 sink 下载数据，
+# 统计首字节延迟、每条流的吞吐量和 ioserver、ioclient 的内存峰值
+#
+#   test/bench.py --bin src --flows 8 --size 4 --delay 50 --jitter 10 --rate 512
+#   test/bench.py --where server --read-rate 64 --stall-every 5 --stall-for 1
+#
+# --where client 时 shim 位于 ioclient 与 ioserver 之间，server 时位于 ioserver 与 sink 之间，
+# none 时不经过 shim，作为对照。其余故障参数原样传给 shim.py。
+# 只使用回环地址，不需要 root 和 netem。
+
+import argparse
+import os
+import pwd
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+SHIM_ARGS = ['delay', 'jitter', 'rate', 'stall_every', 'stall_for', 'read_rate', 'direction']
+
+
+def parse_args():
+	p = argparse.ArgumentParser(description='relay benchmark over a degraded loopback link')
+	p.add_argument('--bin', default='src', help='directory containing ioserver and ioclient')
+	p.add_argument('--port', type=int, default=22205, help='base port, the next 3 are used as well')
+	p.add_argument('--flows', type=int, default=8, help='concurrent downloads')
+	p.add_argument('--size', type=float, default=4, help='MB downloaded by each flow')
+	p.add_argument('--timeout', type=float, default=120, help='seconds before a flow is given up')
+	p.add_argument('--where', choices=['client', 'server', 'none'], default='client',
+	               help='put the shim between ioclient and ioserver, or ioserver and the sink')
+	p.add_argument('--delay', type=float, default=0, help='passed to shim.py')
+	p.add_argument('--jitter', type=float, default=0, help='passed to shim.py')
+	p.add_argument('--rate', type=float, default=0, help='passed to shim.py')
+	p.add_argument('--stall-every', type=float, default=0, help='passed to shim.py')
+	p.add_argument('--stall-for', type=float, default=0, help='passed to shim.py')
+	p.add_argument('--read-rate', type=float, default=0, help='passed to shim.py')
+	p.add_argument('--direction', choices=['up', 'down', 'both'], default='both',
+	               help='passed to shim.py')
+	return p.parse_args()
+
+
+def sink(args, listener):
+	# 每个连接发送 size MB 后关闭
+	chunk = b'\0' * 65536
+	total = int(args.size * 1024 * 1024)
+
+	def serve(c):
+		try:
+			left = total
+			while left > 0:
+				left -= c.send(chunk[:min(left, len(chunk))])
+		except OSError:
+			pass
+		finally:
+			c.close()
+
+	while True:
+		c, _ = listener.accept()
+		threading.Thread(target=serve, args=(c,), daemon=True).start()
+
+
+def flow(args, dest, result):
+	# 经 ioclient 的 SOCKS5 端口下载，记录首字节延迟和总耗时
+	start = time.monotonic()
+	first = None
+	got = 0
+	try:
+		s = socket.create_connection(('127.0.0.1', args.port + 1), args.timeout)
+		s.sendall(b'\x05\x01\x00')
+		s.recv(2)
+		s.sendall(b'\x05\x01\x00\x01' + socket.inet_aton(dest[0]) + struct.pack('>H', dest[1]))
+		reply = b''
+		while len(reply) < 10:
+			data = s.recv(10 - len(reply))
+			if not data:
+				raise OSError('socks5 request rejected')
+			reply += data
+		while True:
+			data = s.recv(65536)
+			if not data:
+				break
+			if first is None:
+				first = time.monotonic() - start
+			got += len(data)
+		s.close()
+	except OSError as e:
+		print('flow: %s' % e, file=sys.stderr)
+	result.append((first, got, time.monotonic() - start))
+
+
+def peak(pid):
+	# VmHWM 为进程常驻内存的峰值，单位 KB
+	with open('/proc/%d/status' % pid) as f:
+		for line in f:
+			if line.startswith('VmHWM:'):
+				return int(line.split()[1])
+	return 0
+
+
+def percentile(values, p):
+	values = sorted(values)
+	return values[min(len(values) - 1, int(len(values) * p))] if values else 0
+
+
+def write_conf(path, user, server_port, local_port):
+	with open(path, 'w') as f:
+		f.write('[global]\nuser=%s\n\n' % user)
+		f.write('[server]\naddress=127.0.0.1\nport=%d\nkey=bench\n\n' % server_port)
+		f.write('[local]\naddress=127.0.0.1\nport=%d\n' % local_port)
+
+
+def main():
+	args = parse_args()
+	listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+	listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+	listener.bind(('127.0.0.1', args.port + 2))
+	listener.listen(1024)
+	threading.Thread(target=sink, args=(args, listener), daemon=True).start()
+
+	# ioserver 监听 port，ioclient 监听 port + 1，sink 监听 port + 2，shim 监听 port + 3
+	tmp = tempfile.mkdtemp(prefix='bench.')
+	user = pwd.getpwuid(os.getuid()).pw_name
+	server_conf = os.path.join(tmp, 'server.conf')
+	client_conf = os.path.join(tmp, 'client.conf')
+	write_conf(server_conf, user, args.port, args.port + 1)
+	write_conf(client_conf, user, args.port + 3 if args.where == 'client' else args.port, args.port + 1)
+	dest = ('127.0.0.1', args.port + 3 if args.where == 'server' else args.port + 2)
+
+	procs = []
+	if args.where != 'none':
+		cmd = [sys.executable, os.path.join(os.path.dirname(os.path.abspath(__file__)), 'shim.py'),
+		       '--listen', '127.0.0.1:%d' % (args.port + 3),
+		       '--connect', '127.0.0.1:%d' % (args.port if args.where == 'client' else args.port + 2)]
+		for name in SHIM_ARGS:
+			cmd += ['--' + name.replace('_', '-'), str(getattr(args, name))]
+		procs.append(subprocess.Popen(cmd))
+	server = subprocess.Popen([os.path.join(args.bin, 'ioserver'), '-c', server_conf],
+	                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+	client = subprocess.Popen([os.path.join(args.bin, 'ioclient'), '-c', client_conf],
+	                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+	procs += [server, client]
+	time.sleep(1)
+	try:
+		result = []
+		threads = [threading.Thread(target=flow, args=(args, dest, result)) for _ in range(args.flows)]
+		start = time.monotonic()
+		for t in threads:
+			t.start()
+		for t in threads:
+			t.join()
+		elapsed = time.monotonic() - start
+		want = int(args.size * 1024 * 1024)
+		done = [r for r in result if r[1] == want]
+		ttfb = [r[0] * 1000 for r in result if r[0] is not None]
+		rate = [r[1] / 1024 / r[2] for r in done]
+		print('flows %d, completed %d, %.1f s, total %.0f KB/s' % (
+			args.flows, len(done), elapsed, sum(r[1] for r in result) / 1024 / elapsed))
+		print('first byte: p50 %.0f ms, p99 %.0f ms' % (percentile(ttfb, 0.5), percentile(ttfb, 0.99)))
+		print('per flow: p50 %.0f KB/s, min %.0f KB/s' % (percentile(rate, 0.5), min(rate or [0])))
+		print('peak rss: ioserver %d KB, ioclient %d KB' % (peak(server.pid), peak(client.pid)))
+		return 0 if len(done) == args.flows else 1
+	finally:
+		for p in procs:
+			p.send_signal(signal.SIGTERM)
+		for p in procs:
+			try:
+				p.wait(5)
+			except subprocess.TimeoutExpired:
+				p.kill()
+
+
+if __name__ == '__main__':
+	try:
+		sys.exit(main())
+	except KeyboardInterrupt:
+		pass
@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+
+# 用户态的 TCP 故障注入代理，放在 ioclient 与 ioserver 之间，或者 ioserver 与目标之间，
+# 模拟延迟、抖动、带宽限制、周期性卡顿和读得很慢的接收方，不需要 root 和 netem
+#
+#   test/shim.py --listen 127.0.0.1:2205 --connect 127.0.0.1:1205 \
+#       --delay 50 --jitter 10 --rate 512 --stall-every 5 --stall-for 1
+#
+# test/bench.py 会自动启动本脚本并在其后压测转发，通常不需要单独运行
+
+import argparse
+import asyncio
+import random
+import sys
+import time
+
+
+def addr(s):
+	host, _, port = s.rpartition(':')
+	return host, int(port)
+
+
+def parse_args():
+	p = argparse.ArgumentParser(description='loopback TCP fault-injection shim')
+	p.add_argument('--listen', type=addr, required=True, help='host:port to accept on')
+	p.add_argument('--connect', type=addr, required=True, help='host:port to forward to')
+	p.add_argument('--delay', type=float, default=0, help='one-way delay in ms')
+	p.add_argument('--jitter', type=float, default=0, help='random extra delay in ms, up to this value')
+	p.add_argument('--rate', type=float, default=0, help='bandwidth cap per direction in KB/s, 0 for none')
+	p.add_argument('--stall-every', type=float, default=0, help='stall all forwarding every N seconds')
+	p.add_argument('--stall-for', type=float, default=0, help='length of each stall in seconds')
+	p.add_argument('--read-rate', type=float, default=0,
+	               help='slow reader: read from the source at most this many KB/s, 0 for no limit')
+	p.add_argument('--chunk', type=int, default=16384, help='read size in bytes')
+	p.add_argument('--direction', choices=['up', 'down', 'both'], default='both',
+	               help='up is listen -> connect, down is connect -> listen')
+	p.add_argument('--stats', type=float, default=0, help='print counters every N seconds')
+	return p.parse_args()
+
+
+class Stats:
+	def __init__(self):
+		self.conns = 0
+		self.active = 0
+		self.bytes = 0
+		self.max_queued = 0
+
+
+class Pacer:
+	# 令牌桶，rate 为 0 时不限速
+	def __init__(self, rate):
+		self.rate = rate * 1024
+		self.next = time.monotonic()
+
+	def reserve(self, n):
+		if self.rate <= 0:
+			return 0
+		now = time.monotonic()
+		self.next = max(self.next, now) + n / self.rate
+		return self.next - now
+
+
+def stalled(args, start):
+	# 距离卡顿结束还有多少秒，不在卡顿中返回 0
+	if args.stall_every <= 0 or args.stall_for <= 0:
+		return 0
+	t = (time.monotonic() - start) % args.stall_every
+	return max(0, args.stall_every - t) if t >= args.stall_every - args.stall_for else 0
+
+
+async def pump(args, stats, start, reader, writer, faulty):
+	# 读取任务按时间戳把数据放进队列，发送任务按时间到达后写出，保持顺序
+	queue = asyncio.Queue(maxsize=64)
+	read_pacer = Pacer(args.read_rate if faulty else 0)
+	link_pacer = Pacer(args.rate if faulty else 0)
+
+	async def produce():
+		last = 0
+		while True:
+			data = await reader.read(args.chunk)
+			if faulty:
+				await asyncio.sleep(read_pacer.reserve(len(data)))
+			if not data:
+				await queue.put((last, b''))
+				return
+			at = time.monotonic()
+			if faulty:
+				at += (args.delay + random.uniform(0, args.jitter)) / 1000 + link_pacer.reserve(len(data))
+			last = max(last, at)
+			await queue.put((last, data))
+			stats.max_queued = max(stats.max_queued, queue.qsize())
+
+	async def consume():
+		while True:
+			at, data = await queue.get()
+			wait = at - time.monotonic()
+			if faulty:
+				wait = max(wait, stalled(args, start))
+			if wait > 0:
+				await asyncio.sleep(wait)
+			if not data:
+				if writer.can_write_eof():
+					writer.write_eof()
+				return
+			writer.write(data)
+			await writer.drain()
+			stats.bytes += len(data)
+
+	try:
+		await asyncio.gather(produce(), consume())
+	except (ConnectionError, asyncio.IncompleteReadError):
+		writer.close()
+
+
+async def handle(args, stats, start, c_reader, c_writer):
+	stats.conns += 1
+	stats.active += 1
+	try:
+		s_reader, s_writer = await asyncio.open_connection(*args.connect)
+	except OSError as e:
+		print('connect failed: %s' % e, file=sys.stderr)
+		c_writer.close()
+		stats.active -= 1
+		return
+	try:
+		await asyncio.gather(
+			pump(args, stats, start, c_reader, s_writer, args.direction in ('up', 'both')),
+			pump(args, stats, start, s_reader, c_writer, args.direction in ('down', 'both')))
+	finally:
+		c_writer.close()
+		s_writer.close()
+		stats.active -= 1
+
+
+async def report(args, stats):
+	while True:
+		await asyncio.sleep(args.stats)
+		print('shim: %d connections, %d active, %d bytes, max %d chunks queued' %
+		      (stats.conns, stats.active, stats.bytes, stats.max_queued), flush=True)
+
+
+async def main():
+	args = parse_args()
+	stats = Stats()
+	start = time.monotonic()
+	server = await asyncio.start_server(lambda r, w: handle(args, stats, start, r, w), *args.listen)
+	if args.stats > 0:
+		asyncio.ensure_future(report(args, stats))
+	async with server:
+		await server.serve_forever()
+
+
+if __name__ == '__main__':
+	try:
+		asyncio.run(main())
+	except KeyboardInterrupt:
+		pass
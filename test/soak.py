@@ -0,0 +1,395 @@
+#!/usr/bin/env python3
+
+# 空闲连接压测：在回环上建立大量几乎不传数据的连接并保持住，
+# 统计 ioserver 和 ioclient 在各个阶段每条连接占用的 RSS、匿名内存和 fd
+#
+#   test/soak.py --bin src --counts 10000,100000 --phases socks5,handshake,connect,relay
+#
+# 阶段：
+#   socks5     连上 ioclient 但不发 SOCKS5 握手，只测 ioclient
+#   handshake  直连 ioserver，只发半个 IV，停在等待请求头的阶段，只测 ioserver
+#              (ioserver 的握手超时为 10 秒，数量大时先建立的连接会被关掉，以存活数为准)
+#   resolve    直连 ioserver，请求 --slow-domain 指定的域名，停在域名解析阶段
+#   connect    直连 ioserver，请求一个 backlog 已满且从不 accept 的地址，停在连接阶段
+#   relay      经 ioclient、ioserver 连到只 accept 不读写的 sink，同时测两者
+#
+# 客户端绑定 127.0.10.x，ioserver 监听 127.0.20.x，sink 监听 127.0.30.x，
+# 每一段都分散到多个地址上，避免单个四元组的端口耗尽。
+# 100 万连接需要先调大 fs.nr_open、ulimit -n 和 net.ipv4.ip_local_port_range，
+# 本脚本只检查并提示，不修改系统设置。
+# 每一步的内存为相对于该步开始前的增量，上一步释放的内存池会让小规模的结果偏低，以大规模为准。
+
+import argparse
+import errno
+import hashlib
+import json
+import os
+import pwd
+import resource
+import select
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+IP_BIND_ADDRESS_NO_PORT = 24
+PHASES = ['socks5', 'handshake', 'resolve', 'connect', 'relay']
+
+
+def parse_args():
+	p = argparse.ArgumentParser(description='idle-connection soak benchmark')
+	p.add_argument('--bin', default='src', help='directory containing ioserver and ioclient')
+	p.add_argument('--counts', default='10000,100000,1000000',
+	               help='comma separated connection counts, one step each')
+	p.add_argument('--phases', default='socks5,handshake,connect,relay',
+	               help='comma separated phases, from: ' + ','.join(PHASES))
+	p.add_argument('--slow-domain', default='',
+	               help='domain whose lookup hangs, required by the resolve phase')
+	p.add_argument('--port', type=int, default=21205, help='base port, the next 3 are used as well')
+	p.add_argument('--servers', type=int, default=16, help='ioserver listen addresses, at most 16')
+	p.add_argument('--sources', type=int, default=64, help='client source addresses')
+	p.add_argument('--dests', type=int, default=16, help='sink and tarpit addresses')
+	p.add_argument('--concurrency', type=int, default=2000, help='handshakes in flight')
+	p.add_argument('--settle', type=float, default=2, help='seconds to wait before sampling')
+	p.add_argument('--json', action='store_true', help='print one JSON object per result')
+	p.add_argument('--role', choices=['bench', 'sink'], default='bench', help=argparse.SUPPRESS)
+	return p.parse_args()
+
+
+def raise_nofile():
+	soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+	if soft < hard:
+		resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+	return hard
+
+
+def sink(args):
+	# 独立进程：在 127.0.30.x 上 accept 并持有连接，从不读写；
+	# 另在 127.0.31.x 上各开一个 backlog 为 1 且从不 accept 的监听，用来把连接卡在 SYN 重传
+	raise_nofile()
+	held = []
+	ep = select.epoll()
+	listeners = {}
+	tarpits = []
+	for i in range(args.dests):
+		s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+		s.bind(('127.0.30.%d' % (i + 1), args.port + 2))
+		s.listen(4096)
+		s.setblocking(False)
+		ep.register(s.fileno(), select.EPOLLIN)
+		listeners[s.fileno()] = s
+		t = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		t.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+		t.bind(('127.0.31.%d' % (i + 1), args.port + 3))
+		t.listen(1)
+		tarpits.append(t)
+	print('ready', flush=True)
+	while True:
+		for fd, _ in ep.poll():
+			s = listeners[fd]
+			while True:
+				try:
+					c, _ = s.accept()
+				except BlockingIOError:
+					break
+				except OSError as e:
+					if e.errno in (errno.EMFILE, errno.ENFILE):
+						break
+					raise
+				held.append(c)
+
+
+class Daemon:
+	def __init__(self, name, path, conf):
+		self.name = name
+		self.proc = subprocess.Popen([path, '-c', conf], stdout=subprocess.DEVNULL,
+		                             stderr=subprocess.DEVNULL)
+
+	def sample(self):
+		# VmRSS 为常驻内存，RssAnon 为匿名页 (malloc、内存池)，单位 KB
+		out = {'rss': 0, 'anon': 0}
+		with open('/proc/%d/status' % self.proc.pid) as f:
+			for line in f:
+				if line.startswith('VmRSS:'):
+					out['rss'] = int(line.split()[1])
+				elif line.startswith('RssAnon:'):
+					out['anon'] = int(line.split()[1])
+		out['fds'] = len(os.listdir('/proc/%d/fd' % self.proc.pid))
+		return out
+
+	def stop(self):
+		self.proc.send_signal(signal.SIGTERM)
+		try:
+			self.proc.wait(5)
+		except subprocess.TimeoutExpired:
+			self.proc.kill()
+
+
+def write_conf(args, path):
+	user = pwd.getpwuid(os.getuid()).pw_name
+	with open(path, 'w') as f:
+		f.write('[global]\nuser=%s\n\n' % user)
+		for i in range(args.servers):
+			f.write('[server]\naddress=127.0.20.%d\nport=%d\nkey=soak\n\n' % (i + 1, args.port))
+		f.write('[local]\naddress=127.0.0.1\nport=%d\n' % (args.port + 1))
+
+
+class RC4:
+	def __init__(self, key):
+		s = list(range(256))
+		j = 0
+		for i in range(256):
+			j = (j + s[i] + key[i % len(key)]) & 255
+			s[i], s[j] = s[j], s[i]
+		self.s = s
+
+	def crypt(self, data):
+		s = list(self.s)
+		out = bytearray(data)
+		i = j = 0
+		for k in range(len(out)):
+			i = (i + 1) & 255
+			j = (j + s[i]) & 255
+			s[i], s[j] = s[j], s[i]
+			out[k] ^= s[(s[i] + s[j]) & 255]
+		return bytes(out)
+
+
+def iosocks_header(atyp, addr, port):
+	# 紧凑格式请求头：IV + RC4(VER ATYP ADDR PORT MAC)
+	# 压测只需要让 ioserver 走到下一阶段，所有连接共用同一个 IV
+	key = hashlib.md5(b'soak').digest()
+	iv = hashlib.md5(b'soak-iv').digest()
+	hdr = b'\x01' + bytes([atyp]) + addr + struct.pack('>H', port)
+	mac = hashlib.md5(iv + key + hdr).digest()[:4]
+	return iv + RC4(hashlib.md5(iv + key).digest()).crypt(hdr + mac)
+
+
+class Load:
+	# 非阻塞建立连接并推进到指定阶段，之后从 epoll 中移除并一直持有
+	def __init__(self, args, phase):
+		self.args = args
+		self.phase = phase
+		self.ep = select.epoll()
+		self.state = {}
+		self.held = []
+		self.failed = 0
+		self.seq = 0
+		if phase == 'socks5' or phase == 'relay':
+			self.target = [('127.0.0.1', args.port + 1)]
+		else:
+			self.target = [('127.0.20.%d' % (i + 1), args.port) for i in range(args.servers)]
+		if phase == 'handshake':
+			self.payload = [iosocks_header(1, b'\0' * 4, 0)[:8]]
+		elif phase == 'resolve':
+			name = args.slow_domain.encode()
+			self.payload = [iosocks_header(3, bytes([len(name)]) + name, 80)]
+		elif phase == 'connect':
+			self.payload = [iosocks_header(1, socket.inet_aton('127.0.31.%d' % (i + 1)), args.port + 3)
+			                for i in range(args.dests)]
+
+	def open_one(self):
+		n = self.seq
+		self.seq += 1
+		s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		s.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack('ii', 1, 0))
+		s.setsockopt(socket.IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, 1)
+		s.bind(('127.0.10.%d' % (n % self.args.sources + 1), 0))
+		s.setblocking(False)
+		err = s.connect_ex(self.target[n % len(self.target)])
+		if err not in (0, errno.EINPROGRESS):
+			s.close()
+			self.failed += 1
+			return
+		self.state[s.fileno()] = [s, 0, n, b'']
+		self.ep.register(s.fileno(), select.EPOLLOUT)
+
+	def done(self, fd):
+		st = self.state.pop(fd)
+		self.ep.unregister(fd)
+		self.held.append(st[0])
+
+	def fail(self, fd):
+		st = self.state.pop(fd)
+		self.ep.unregister(fd)
+		st[0].close()
+		self.failed += 1
+
+	def step(self, fd, ev):
+		st = self.state[fd]
+		s = st[0]
+		if st[1] == 0:
+			if s.getsockopt(socket.SOL_SOCKET, socket.SO_ERROR) != 0:
+				return self.fail(fd)
+			if self.phase == 'socks5':
+				return self.done(fd)
+			if self.phase == 'relay':
+				s.send(b'\x05\x01\x00')
+				st[1] = 1
+				self.ep.modify(fd, select.EPOLLIN)
+				return
+			s.send(self.payload[st[2] % len(self.payload)])
+			return self.done(fd)
+		try:
+			data = s.recv(64)
+		except BlockingIOError:
+			return
+		except OSError:
+			return self.fail(fd)
+		if not data:
+			return self.fail(fd)
+		st[3] += data
+		if st[1] == 1 and len(st[3]) >= 2:
+			dest = socket.inet_aton('127.0.30.%d' % (st[2] % self.args.dests + 1))
+			s.send(b'\x05\x01\x00\x01' + dest + struct.pack('>H', self.args.port + 2))
+			st[1] = 2
+			st[3] = st[3][2:]
+		if st[1] == 2 and len(st[3]) >= 10:
+			self.done(fd)
+
+	def run(self, count):
+		while len(self.held) + self.failed < count:
+			while len(self.state) < self.args.concurrency and self.seq < count:
+				try:
+					self.open_one()
+				except OSError as e:
+					print('open: %s' % e, file=sys.stderr)
+					self.failed += count - self.seq
+					self.seq = count
+			if not self.state:
+				break
+			for fd, ev in self.ep.poll(5):
+				if ev & (select.EPOLLERR | select.EPOLLHUP):
+					self.fail(fd)
+				else:
+					self.step(fd, ev)
+
+	def alive(self):
+		# 对端关闭的连接会变为可读，剩下的才算存活
+		ep = select.epoll()
+		for s in self.held:
+			ep.register(s.fileno(), select.EPOLLIN | select.EPOLLRDHUP)
+		dead = 0
+		while True:
+			evs = ep.poll(0, 65536)
+			dead += len(evs)
+			for fd, _ in evs:
+				ep.unregister(fd)
+			if len(evs) < 65536:
+				break
+		ep.close()
+		return len(self.held) - dead
+
+	def close(self):
+		for s in self.held:
+			s.close()
+		for st in self.state.values():
+			st[0].close()
+		self.held = []
+		self.state = {}
+		self.ep.close()
+
+
+def wait_idle(daemons, base, timeout=180):
+	# 等待守护进程释放上一轮的连接，connect 阶段要等 SYN 重传超时 (默认约 127 秒)
+	deadline = time.monotonic() + timeout
+	while time.monotonic() < deadline:
+		if all(d.sample()['fds'] <= base[d.name]['fds'] + 4 for d in daemons):
+			return
+		time.sleep(0.5)
+	print('warning: connections from the last step are still open, later results may be skewed',
+	      file=sys.stderr)
+
+
+def report(args, phase, count, load, alive, elapsed, d, before, after):
+	n = max(alive, 1)
+	r = {
+		'phase': phase,
+		'daemon': d.name,
+		'requested': count,
+		'opened': len(load.held),
+		'failed': load.failed,
+		'alive': alive,
+		'seconds': round(elapsed, 1),
+		'rss_kb': after['rss'] - before['rss'],
+		'anon_kb': after['anon'] - before['anon'],
+		'fds': after['fds'] - before['fds'],
+		'rss_per_conn': round((after['rss'] - before['rss']) * 1024 / n),
+		'anon_per_conn': round((after['anon'] - before['anon']) * 1024 / n),
+		'fds_per_conn': round((after['fds'] - before['fds']) / n, 2),
+	}
+	if args.json:
+		print(json.dumps(r), flush=True)
+	else:
+		print('%-9s %-8s %8d %8d %7d %9d B %9d B %6.2f' % (
+			phase, d.name, count, alive, load.failed,
+			r['rss_per_conn'], r['anon_per_conn'], r['fds_per_conn']), flush=True)
+
+
+def main():
+	args = parse_args()
+	if args.role == 'sink':
+		return sink(args)
+	counts = [int(x) for x in args.counts.split(',') if x]
+	phases = [x for x in args.phases.split(',') if x]
+	for p in phases:
+		if p not in PHASES:
+			sys.exit('unknown phase: %s' % p)
+	if 'resolve' in phases and not args.slow_domain:
+		sys.exit('resolve phase requires --slow-domain')
+	args.servers = min(args.servers, 16)
+
+	limit = raise_nofile()
+	need = max(counts) * 2 + 1024
+	if limit < need:
+		print('warning: RLIMIT_NOFILE is %d, the largest step needs about %d per process' % (limit, need),
+		      file=sys.stderr)
+	with open('/proc/sys/net/ipv4/ip_local_port_range') as f:
+		lo, hi = map(int, f.read().split())
+	if (hi - lo) * args.servers < max(counts):
+		print('warning: ip_local_port_range %d-%d is too small for ioclient -> ioserver' % (lo, hi),
+		      file=sys.stderr)
+
+	tmp = tempfile.mkdtemp(prefix='soak.')
+	conf = os.path.join(tmp, 'soak.conf')
+	write_conf(args, conf)
+	sinkp = subprocess.Popen([sys.executable, __file__, '--role', 'sink', '--port', str(args.port),
+	                          '--dests', str(args.dests)], stdout=subprocess.PIPE)
+	sinkp.stdout.readline()
+	server = Daemon('ioserver', os.path.join(args.bin, 'ioserver'), conf)
+	client = Daemon('ioclient', os.path.join(args.bin, 'ioclient'), conf)
+	time.sleep(1)
+	try:
+		if not args.json:
+			print('%-9s %-8s %8s %8s %7s %11s %11s %6s' % (
+				'phase', 'daemon', 'count', 'alive', 'failed', 'rss/conn', 'anon/conn', 'fds'))
+		for phase in phases:
+			daemons = [client] if phase == 'socks5' else [server] if phase != 'relay' else [client, server]
+			for count in counts:
+				base = {d.name: d.sample() for d in (client, server)}
+				load = Load(args, phase)
+				start = time.monotonic()
+				load.run(count)
+				elapsed = time.monotonic() - start
+				time.sleep(args.settle)
+				after = {d.name: d.sample() for d in daemons}
+				alive = load.alive()
+				for d in daemons:
+					report(args, phase, count, load, alive, elapsed, d, base[d.name], after[d.name])
+				load.close()
+				wait_idle([client, server], base)
+	finally:
+		client.stop()
+		server.stop()
+		sinkp.kill()
+
+
+if __name__ == '__main__':
+	try:
+		main()
+	except KeyboardInterrupt:
+		pass